@@ -0,0 +1,398 @@
+#ifndef ASYNC_IO_FINAL_H
+#define ASYNC_IO_FINAL_H
+
+#include<vector>
+#include<queue>
+#include<memory>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+#include<future>
+#include<thread>
+#include<algorithm>
+#include<cstdint>
+#include<cstring>
+#include<cerrno>
+#include<sys/types.h>
+#include<sys/mman.h>
+#include<sys/eventfd.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+#include<linux/io_uring.h>
+#if defined(__cpp_impl_coroutine)
+#include<coroutine>
+#endif
+#include "threadpool_final.h"
+
+const unsigned ASYNC_IO_ENTRIES =256; //io_uring提交队列大小，也是同时在途的I/O数量上限
+const int ASYNC_IO_FALLBACK_THREADS =4; //没有io_uring时，执行阻塞pread/pwrite的专用线程数
+
+/*
+异步文件I/O：读写请求提交给io_uring，完成后回调作为任务投递到线程池(或恢复等待它的协程)
+1.任务中直接read()/write()会阻塞池内线程，固定hardware_concurrency()个线程的线程池I/O一多就没有线程算CPU任务了
+2.io_uring由一个完成线程阻塞等待完成事件，池内线程只负责提交和执行回调，一个小线程池也能同时有几百个I/O在途
+3.内核不支持io_uring(或不支持READ/WRITE操作)时，自动退化为几个专用线程执行阻塞pread/pwrite，接口不变
+回调参数与pread/pwrite返回值一致：成功为字节数，失败为-errno
+
+example:
+AsyncFileIO io(pool);
+io.asyncRead(fd,buf,4096,0,[](ssize_t n){ ... }); //回调在线程池中执行
+std::future<ssize_t> r=io.write(fd,data,len,offset);
+//C++20协程：ssize_t n=co_await io.readAwait(fd,buf,4096,0); 恢复后运行在线程池线程上
+*/
+class AsyncFileIO{
+public:
+    using Callback=std::function<void(ssize_t)>;
+
+    explicit AsyncFileIO(ThreadPool& pool,unsigned entries=ASYNC_IO_ENTRIES,bool useIoUring=true)
+        : pool_(pool)
+        , ringFd_(-1)
+        , eventFd_(-1)
+        , inflight_(0)
+        , maxInflight_(entries>0?entries:1)
+        , isRunning_(true)
+    {
+        if(!useIoUring || !setupIoUring(maxInflight_)){
+            for(int i=0;i<ASYNC_IO_FALLBACK_THREADS;++i){
+                ioThreads_.emplace_back(&AsyncFileIO::fallbackFunc,this);
+            }
+        }
+    }
+
+    //等待所有在途的I/O完成(回调已投递到线程池)后再释放资源
+    ~AsyncFileIO()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            notFull_.wait(lock,[&]()->bool{ return inflight_==0; });
+            isRunning_=false;
+            fallbackCond_.notify_all();
+        }
+        if(eventFd_>=0){
+            //直接写eventfd唤醒完成线程：不经过io_uring提交，不存在“唤醒请求提交失败导致join()永远等待”的问题
+            std::uint64_t one=1;
+            while(::write(eventFd_,&one,sizeof(one))<0 && errno==EINTR){}
+        }
+        for(std::thread& t:ioThreads_){
+            t.join();
+        }
+        releaseIoUring();
+    }
+
+    //是否使用io_uring(false表示线程退化实现)
+    bool usingIoUring() const
+    {
+        return ringFd_>=0;
+    }
+
+    //异步读：完成后cb(结果)作为任务投递到线程池；在途I/O达到上限时阻塞等待
+    void asyncRead(int fd,void* buf,std::size_t len,off_t offset,Callback cb)
+    {
+        submit(false,fd,buf,len,offset,std::move(cb));
+    }
+
+    //异步写
+    void asyncWrite(int fd,const void* buf,std::size_t len,off_t offset,Callback cb)
+    {
+        submit(true,fd,const_cast<void*>(buf),len,offset,std::move(cb));
+    }
+
+    std::future<ssize_t> read(int fd,void* buf,std::size_t len,off_t offset)
+    {
+        auto promise=std::make_shared<std::promise<ssize_t>>();
+        asyncRead(fd,buf,len,offset,[promise](ssize_t n){ promise->set_value(n); });
+        return promise->get_future();
+    }
+
+    std::future<ssize_t> write(int fd,const void* buf,std::size_t len,off_t offset)
+    {
+        auto promise=std::make_shared<std::promise<ssize_t>>();
+        asyncWrite(fd,buf,len,offset,[promise](ssize_t n){ promise->set_value(n); });
+        return promise->get_future();
+    }
+
+#if defined(__cpp_impl_coroutine)
+    //co_await的对象：I/O完成后协程在线程池线程上恢复
+    struct IoAwaitable
+    {
+        AsyncFileIO& io_;
+        bool write_;
+        int fd_;
+        void* buf_;
+        std::size_t len_;
+        off_t offset_;
+        ssize_t result_=0;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            io_.submit(write_,fd_,buf_,len_,offset_,[this,handle](ssize_t n){
+                result_=n;
+                handle.resume();
+            });
+        }
+        ssize_t await_resume() const noexcept { return result_; }
+    };
+
+    IoAwaitable readAwait(int fd,void* buf,std::size_t len,off_t offset)
+    {
+        return IoAwaitable{*this,false,fd,buf,len,offset};
+    }
+
+    IoAwaitable writeAwait(int fd,const void* buf,std::size_t len,off_t offset)
+    {
+        return IoAwaitable{*this,true,fd,const_cast<void*>(buf),len,offset};
+    }
+#endif
+
+    AsyncFileIO(const AsyncFileIO&)=delete;
+    AsyncFileIO& operator=(const AsyncFileIO&)=delete;
+
+private:
+    //一次I/O请求
+    struct Op
+    {
+        bool write_;
+        int fd_;
+        void* buf_;
+        std::size_t len_;
+        off_t offset_;
+        Callback cb_;
+    };
+
+    void submit(bool write,int fd,void* buf,std::size_t len,off_t offset,Callback cb)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        //在途I/O数量不超过提交队列大小：io_uring的SQ/CQ都不会溢出
+        notFull_.wait(lock,[&]()->bool{ return inflight_<maxInflight_; });
+        inflight_++;
+        Op* op=new Op{write,fd,buf,len,offset,std::move(cb)};
+        if(ringFd_>=0){
+            int err=submitSqeLocked(write?IORING_OP_WRITE:IORING_OP_READ,fd,buf,len,offset,op);
+            if(err!=0){
+                //提交失败：按失败完成处理，解锁后再投递回调
+                cb=std::move(op->cb_);
+                delete op;
+                inflight_--;
+                notFull_.notify_all();
+                lock.unlock();
+                pool_.post([cb,err](){ cb(-err); });
+            }
+        }
+        else{
+            fallbackQue_.push(op);
+            fallbackCond_.notify_one();
+        }
+    }
+
+    //I/O完成：回调投递到线程池，归还在途名额
+    //先加锁再访问op：op经内核传回，加锁与提交方建立happens-before
+    void complete(Op* op,ssize_t result)
+    {
+        Callback cb;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cb=std::move(op->cb_);
+            delete op;
+            inflight_--;
+            notFull_.notify_all();
+        }
+        pool_.post([cb,result](){ cb(result); });
+    }
+
+    ////////////// io_uring实现(直接使用系统调用，不依赖liburing)
+    bool setupIoUring(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params,0,sizeof(params));
+        int fd=(int)syscall(__NR_io_uring_setup,entries,&params);
+        if(fd<0)
+            return false;
+
+        //探测内核是否支持READ/WRITE操作(5.6以上)
+        std::size_t probeSize=sizeof(io_uring_probe)+256*sizeof(io_uring_probe_op);
+        std::vector<char> probeBuf(probeSize,0);
+        io_uring_probe* probe=reinterpret_cast<io_uring_probe*>(probeBuf.data());
+        if(syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256)<0
+            || probe->last_op<IORING_OP_WRITE
+            || !(probe->ops[IORING_OP_READ].flags&IO_URING_OP_SUPPORTED)
+            || !(probe->ops[IORING_OP_WRITE].flags&IO_URING_OP_SUPPORTED))
+        {
+            close(fd);
+            return false;
+        }
+
+        sqRingSize_=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+        cqRingSize_=params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+        bool singleMmap=params.features&IORING_FEAT_SINGLE_MMAP;
+        if(singleMmap){
+            sqRingSize_=cqRingSize_=std::max(sqRingSize_,cqRingSize_);
+        }
+        //之后任一步失败都由releaseIoUring()释放已经分配的部分
+        ringFd_=fd;
+        void* sqRing=mmap(nullptr,sqRingSize_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+        if(sqRing==MAP_FAILED){
+            releaseIoUring();
+            return false;
+        }
+        sqRing_=cqRing_=sqRing;
+        if(!singleMmap){
+            void* cqRing=mmap(nullptr,cqRingSize_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+            if(cqRing==MAP_FAILED){
+                releaseIoUring();
+                return false;
+            }
+            cqRing_=cqRing;
+        }
+        sqesSize_=params.sq_entries*sizeof(io_uring_sqe);
+        void* sqes=mmap(nullptr,sqesSize_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+        if(sqes==MAP_FAILED){
+            releaseIoUring();
+            return false;
+        }
+        sqes_=static_cast<io_uring_sqe*>(sqes);
+
+        //完成事件通过eventfd通知：完成线程阻塞在read(eventFd_)上，析构时也可以直接写它来唤醒
+        eventFd_=eventfd(0,EFD_CLOEXEC);
+        if(eventFd_<0 || syscall(__NR_io_uring_register,fd,IORING_REGISTER_EVENTFD,&eventFd_,1)<0){
+            releaseIoUring();
+            return false;
+        }
+
+        char* sq=static_cast<char*>(sqRing_);
+        sqTail_=reinterpret_cast<unsigned*>(sq+params.sq_off.tail);
+        sqMask_=*reinterpret_cast<unsigned*>(sq+params.sq_off.ring_mask);
+        sqArray_=reinterpret_cast<unsigned*>(sq+params.sq_off.array);
+        char* cq=static_cast<char*>(cqRing_);
+        cqHead_=reinterpret_cast<unsigned*>(cq+params.cq_off.head);
+        cqTail_=reinterpret_cast<unsigned*>(cq+params.cq_off.tail);
+        cqMask_=*reinterpret_cast<unsigned*>(cq+params.cq_off.ring_mask);
+        cqes_=reinterpret_cast<io_uring_cqe*>(cq+params.cq_off.cqes);
+
+        maxInflight_=std::min(maxInflight_,params.sq_entries);
+        ioThreads_.emplace_back(&AsyncFileIO::completionFunc,this);
+        return true;
+    }
+
+    //释放io_uring相关资源(也用于初始化中途失败)，之后usingIoUring()返回false
+    void releaseIoUring()
+    {
+        if(sqes_!=nullptr)
+            munmap(sqes_,sqesSize_);
+        if(cqRing_!=nullptr && cqRing_!=sqRing_)
+            munmap(cqRing_,cqRingSize_);
+        if(sqRing_!=nullptr)
+            munmap(sqRing_,sqRingSize_);
+        if(eventFd_>=0)
+            close(eventFd_);
+        if(ringFd_>=0)
+            close(ringFd_);
+        sqes_=nullptr;
+        sqRing_=cqRing_=nullptr;
+        eventFd_=ringFd_=-1;
+    }
+
+    //填写一个SQE并提交，成功返回0，失败返回errno且SQE已撤回
+    //（调用方需持有mtx_；没有SQPOLL时内核在io_uring_enter中同步取走SQE，所以SQ不会满）
+    int submitSqeLocked(int opcode,int fd,void* buf,std::size_t len,off_t offset,Op* op)
+    {
+        unsigned tail=*sqTail_;
+        unsigned index=tail&sqMask_;
+        io_uring_sqe* sqe=&sqes_[index];
+        std::memset(sqe,0,sizeof(*sqe));
+        sqe->opcode=(__u8)opcode;
+        sqe->fd=fd;
+        sqe->addr=(__u64)(uintptr_t)buf;
+        sqe->len=(__u32)len;
+        sqe->off=(__u64)offset;
+        sqe->user_data=(__u64)(uintptr_t)op;
+        sqArray_[index]=index;
+        __atomic_store_n(sqTail_,tail+1,__ATOMIC_RELEASE);
+        int ret;
+        do{
+            ret=(int)syscall(__NR_io_uring_enter,ringFd_,1,0,0,nullptr,0);
+        }while(ret<0 && errno==EINTR);
+        if(ret<0){
+            int err=errno;
+            __atomic_store_n(sqTail_,tail,__ATOMIC_RELEASE);
+            return err;
+        }
+        return 0;
+    }
+
+    //完成线程：阻塞在eventfd上等待完成事件，把回调投递到线程池
+    void completionFunc()
+    {
+        for(;;){
+            std::uint64_t count;
+            if(::read(eventFd_,&count,sizeof(count))<0 && errno==EINTR)
+                continue;
+            unsigned head=*cqHead_;
+            unsigned tail=__atomic_load_n(cqTail_,__ATOMIC_ACQUIRE);
+            while(head!=tail){
+                io_uring_cqe* cqe=&cqes_[head&cqMask_];
+                Op* op=reinterpret_cast<Op*>((uintptr_t)cqe->user_data);
+                ssize_t result=cqe->res;
+                ++head;
+                __atomic_store_n(cqHead_,head,__ATOMIC_RELEASE);
+                complete(op,result);
+            }
+            //析构函数在所有I/O完成后才置isRunning_=false并写eventfd
+            std::unique_lock<std::mutex> lock(mtx_);
+            if(!isRunning_ && inflight_==0)
+                return;
+        }
+    }
+
+    ////////////// 线程退化实现
+    void fallbackFunc()
+    {
+        for(;;){
+            Op* op;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                fallbackCond_.wait(lock,[&]()->bool{ return !fallbackQue_.empty() || !isRunning_; });
+                if(fallbackQue_.empty())
+                    return;
+                op=fallbackQue_.front();
+                fallbackQue_.pop();
+            }
+            ssize_t n=op->write_?pwrite(op->fd_,op->buf_,op->len_,op->offset_)
+                                :pread(op->fd_,op->buf_,op->len_,op->offset_);
+            complete(op,n<0?-errno:n);
+        }
+    }
+
+private:
+    ThreadPool& pool_;
+
+    //io_uring相关
+    int ringFd_; //-1表示没有使用io_uring
+    int eventFd_; //注册到io_uring的完成通知eventfd
+    void* sqRing_=nullptr;
+    void* cqRing_=nullptr;
+    std::size_t sqRingSize_=0;
+    std::size_t cqRingSize_=0;
+    std::size_t sqesSize_=0;
+    io_uring_sqe* sqes_=nullptr;
+    unsigned* sqTail_=nullptr;
+    unsigned* sqArray_=nullptr;
+    unsigned sqMask_=0;
+    unsigned* cqHead_=nullptr;
+    unsigned* cqTail_=nullptr;
+    unsigned cqMask_=0;
+    io_uring_cqe* cqes_=nullptr;
+
+    //线程退化实现相关
+    std::queue<Op*> fallbackQue_;
+    std::condition_variable fallbackCond_;
+
+    std::vector<std::thread> ioThreads_; //io_uring完成线程，或退化实现的I/O线程
+    std::mutex mtx_; //保护提交队列与在途计数
+    std::condition_variable notFull_; //在途I/O数量低于上限
+    unsigned inflight_; //在途I/O数量
+    unsigned maxInflight_; //在途I/O数量上限
+    bool isRunning_;
+};
+
+#endif
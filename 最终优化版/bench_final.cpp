@@ -0,0 +1,213 @@
+#include<iostream>
+#include<chrono>
+#include<cstring>
+#include<linux/perf_event.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+#include "threadpool_final.h"
+#include "typed_threadpool_final.h"
+using namespace std;
+
+//小任务吞吐量测试：每个任务只做一次原子自增，耗时主要在任务队列的加锁/解锁上
+//prefill=true：先把任务全部放入队列再启动线程，只测量线程取任务的一侧
+double benchTinyTasks(int threadSize,int batchSize,int taskCount,bool prefill){
+    ThreadPool pool;
+    pool.setTaskQuemaxThreshHold(taskCount);
+    pool.setTaskBatchSize(batchSize);
+
+    atomic_int done(0);
+    auto submitAll=[&](){
+        for(int i=0;i<taskCount;i++){
+            pool.post([&done](){ done.fetch_add(1,memory_order_relaxed); });
+        }
+    };
+    if(prefill){
+        submitAll();
+    }
+    auto begin=chrono::steady_clock::now();
+    pool.start(threadSize);
+    if(!prefill){
+        submitAll();
+    }
+    while(done.load()<taskCount){
+        this_thread::yield();
+    }
+    auto end=chrono::steady_clock::now();
+    double sec=chrono::duration<double>(end-begin).count();
+    return taskCount/sec;
+}
+
+struct AddOne{
+    long long operator()(long long x) const { return x+1; }
+};
+
+//同一种任务：submitTask(类型擦除+future) 与 TypedThreadPool(环形队列+预分配结果槽位) 的吞吐量对比
+void benchTypedPool(int threadSize,int taskCount){
+    vector<long long> results(taskCount);
+    double erased,typed;
+    {
+        ThreadPool pool;
+        pool.setTaskQuemaxThreshHold(taskCount);
+        pool.start(threadSize);
+        vector<future<long long>> futures;
+        futures.reserve(taskCount);
+        auto begin=chrono::steady_clock::now();
+        for(int i=0;i<taskCount;i++){
+            futures.push_back(pool.submitTask(AddOne(),(long long)i));
+        }
+        for(int i=0;i<taskCount;i++){
+            results[i]=futures[i].get();
+        }
+        erased=taskCount/chrono::duration<double>(chrono::steady_clock::now()-begin).count();
+    }
+    {
+        TypedThreadPool<AddOne,long long,long long> pool(AddOne(),taskCount);
+        pool.start(threadSize);
+        auto begin=chrono::steady_clock::now();
+        for(int i=0;i<taskCount;i++){
+            pool.submitTask(&results[i],i);
+        }
+        pool.wait();
+        typed=taskCount/chrono::duration<double>(chrono::steady_clock::now()-begin).count();
+    }
+    cout<<"threads="<<threadSize
+        <<"  submitTask: "<<(long long)erased<<" tasks/s"
+        <<"  TypedThreadPool: "<<(long long)typed<<" tasks/s"
+        <<"  speedup="<<typed/erased<<endl;
+}
+
+//硬件cache-misses计数器(perf_event_open)：统计本进程及之后创建的线程
+//内核不允许(perf_event_paranoid、容器权限、虚拟机没有PMU)时不可用，测试只输出吞吐量
+class CacheMissCounter{
+public:
+    CacheMissCounter()
+    {
+        perf_event_attr attr;
+        memset(&attr,0,sizeof(attr));
+        attr.type=PERF_TYPE_HARDWARE;
+        attr.size=sizeof(attr);
+        attr.config=PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled=1;
+        attr.inherit=1; //计入之后创建的线程，所以要在启动线程之前构造
+        attr.exclude_kernel=1;
+        attr.exclude_hv=1;
+        fd_=(int)syscall(__NR_perf_event_open,&attr,0,-1,-1,0);
+    }
+    ~CacheMissCounter()
+    {
+        if(fd_>=0) close(fd_);
+    }
+    bool available() const { return fd_>=0; }
+    void start()
+    {
+        if(fd_<0) return;
+        ioctl(fd_,PERF_EVENT_IOC_RESET,0);
+        ioctl(fd_,PERF_EVENT_IOC_ENABLE,0);
+    }
+    long long stop()
+    {
+        if(fd_<0) return -1;
+        ioctl(fd_,PERF_EVENT_IOC_DISABLE,0);
+        long long count=0;
+        if(read(fd_,&count,sizeof(count))!=(ssize_t)sizeof(count)) return -1;
+        return count;
+    }
+private:
+    int fd_;
+};
+
+//输出“每次操作的cache-misses”，计数器不可用时输出n/a
+string missesPerOp(long long misses,long long ops){
+    if(misses<0) return "n/a";
+    return to_string((double)misses/ops);
+}
+
+//计数器争用测试：每个线程反复+1/-1(与线程每批任务前后修改空闲线程数量的方式相同)
+//对比所有线程共用一个原子变量 与 ShardedCounter(每个线程修改自己缓存行上的分片)
+void benchCounter(int threadSize,int iterations){
+    auto run=[&](auto& counter,auto add)->void{
+        CacheMissCounter misses;
+        vector<thread> threads;
+        atomic_bool go(false);
+        for(int t=0;t<threadSize;t++){
+            threads.emplace_back([&,t](){
+                while(!go.load()) this_thread::yield();
+                for(int i=0;i<iterations;i++){
+                    add(counter,t,-1);
+                    add(counter,t,1);
+                }
+            });
+        }
+        misses.start();
+        auto begin=chrono::steady_clock::now();
+        go=true;
+        for(thread& th:threads) th.join();
+        double sec=chrono::duration<double>(chrono::steady_clock::now()-begin).count();
+        long long missCount=misses.stop();
+        long long ops=2LL*iterations*threadSize;
+        cout<<"  "<<(long long)(ops/sec)<<" ops/s  cache-misses/op="<<missesPerOp(missCount,ops);
+    };
+    cout<<"threads="<<threadSize<<endl<<"  shared atomic:";
+    atomic_long shared(0);
+    run(shared,[](atomic_long& c,int,long d){ c.fetch_add(d,memory_order_relaxed); });
+    cout<<endl<<"  ShardedCounter:";
+    ShardedCounter sharded;
+    run(sharded,[](ShardedCounter& c,int t,long d){ c.add(t,d); });
+    cout<<endl;
+}
+
+//线程池整体争用：一个生产者持续post小任务，统计吞吐量与每个任务的cache-misses
+void benchPoolContention(int threadSize,int taskCount){
+    CacheMissCounter misses; //在线程池创建线程之前打开
+    ThreadPool pool;
+    pool.setTaskQuemaxThreshHold(taskCount);
+    atomic_int done(0);
+    pool.start(threadSize);
+    misses.start();
+    auto begin=chrono::steady_clock::now();
+    for(int i=0;i<taskCount;i++){
+        pool.post([&done](){ done.fetch_add(1,memory_order_relaxed); });
+    }
+    while(done.load()<taskCount){
+        this_thread::yield();
+    }
+    double sec=chrono::duration<double>(chrono::steady_clock::now()-begin).count();
+    long long missCount=misses.stop();
+    cout<<"threads="<<threadSize
+        <<"  "<<(long long)(taskCount/sec)<<" tasks/s"
+        <<"  cache-misses/task="<<missesPerOp(missCount,taskCount)<<endl;
+}
+
+int main(int argc,char* argv[]){
+    int taskCount=argc>1?atoi(argv[1]):1000000;
+    int maxThreads=max(2,(int)thread::hardware_concurrency());
+
+    cout<<"tiny tasks: "<<taskCount<<endl;
+    for(int prefill=1;prefill>=0;prefill--){
+        cout<<(prefill?"[prefilled queue]":"[concurrent producer]")<<endl;
+        for(int threadSize=1;threadSize<=maxThreads;threadSize*=2){
+            double single=benchTinyTasks(threadSize,1,taskCount,prefill);
+            double batched=benchTinyTasks(threadSize,TASK_MAX_BATCH,taskCount,prefill);
+            cout<<"threads="<<threadSize
+                <<"  batch=1: "<<(long long)single<<" tasks/s"
+                <<"  batch="<<TASK_MAX_BATCH<<": "<<(long long)batched<<" tasks/s"
+                <<"  speedup="<<batched/single<<endl;
+        }
+    }
+
+    cout<<"[typed pool]"<<endl;
+    for(int threadSize=1;threadSize<=maxThreads;threadSize*=2){
+        benchTypedPool(threadSize,taskCount);
+    }
+
+    cout<<"[counter contention]"<<(CacheMissCounter().available()?"":" (perf_event_open unavailable: cache-misses n/a)")<<endl;
+    for(int threadSize=1;threadSize<=maxThreads;threadSize*=2){
+        benchCounter(threadSize,taskCount);
+    }
+    cout<<"[pool contention]"<<endl;
+    for(int threadSize=1;threadSize<=maxThreads;threadSize*=2){
+        benchPoolContention(threadSize,taskCount);
+    }
+    return 0;
+}
@@ -0,0 +1,348 @@
+#ifndef PARALLEL_FINAL_H
+#define PARALLEL_FINAL_H
+
+#include<vector>
+#include<memory>
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+#include<algorithm>
+#include<iterator>
+#include<exception>
+#include<unistd.h> //sysconf()
+#include "threadpool_final.h"
+
+/*
+基于线程池的并行算法：parallelSort、parallelInclusiveScan、parallelExclusiveScan、parallelTransform、parallelFindIf
+1.数据被切分成若干“块”，调用线程与池内线程通过一个原子计数器“领取”块，调用线程自己也参与计算
+2.调用线程只等待已被别的线程领走的块，所以在池内任务中嵌套调用也不会死锁
+3.块大小按L2缓存大小计算，保证一个块的数据能留在缓存中
+
+example:
+ThreadPool pool;
+pool.start(4);
+std::vector<int> v(10000000);
+parallelTransform(pool,v.begin(),v.end(),v.begin(),[](int x){ return x*2; });
+parallelSort(pool,v.begin(),v.end());
+auto it=parallelFindIf(pool,v.begin(),v.end(),[](int x){ return x>100; });
+*/
+
+const std::size_t PARALLEL_MIN_GRAIN =1024; //每块最少的元素个数，块太小时调度开销超过计算本身
+const long PARALLEL_DEFAULT_L2_CACHE =256*1024; //获取不到L2缓存大小时使用的默认值(字节)
+
+//L2缓存大小(字节)
+inline std::size_t parallelL2CacheSize()
+{
+    static const std::size_t size=[]()->std::size_t{
+        long bytes=0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        bytes=sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return bytes>0?bytes:PARALLEL_DEFAULT_L2_CACHE;
+    }();
+    return size;
+}
+
+//计算每块的元素个数：一块的数据占L2缓存的一半，同时保证每个线程能分到若干块(负载均衡)
+template<typename T>
+std::size_t parallelGrainSize(ThreadPool& pool,std::size_t n)
+{
+    std::size_t cacheElems=std::max<std::size_t>(1,parallelL2CacheSize()/2/sizeof(T));
+    std::size_t participants=std::max(1,pool.getThreadSize())+1; //池内线程+调用线程
+    std::size_t balanced=n/(participants*4);
+    return std::max(PARALLEL_MIN_GRAIN,std::min(cacheElems,balanced));
+}
+
+//并行执行chunkCount个块：body(i)处理第i块
+//调用线程与池内线程一起领取块，所有块执行完之后返回；块中抛出的第一个异常会在调用线程重新抛出
+template<typename Body>
+void parallelChunks(ThreadPool& pool,std::size_t chunkCount,Body&& body)
+{
+    if(chunkCount==0)
+        return;
+    if(chunkCount==1){
+        body(0);
+        return;
+    }
+
+    //共享状态用shared_ptr保存：池内的辅助任务可能在全部块完成之后才被调度到
+    struct State
+    {
+        std::atomic_size_t next{0}; //下一个待领取的块
+        std::atomic_size_t done{0}; //已完成的块数
+        std::size_t count=0;
+        std::function<void(std::size_t)> body;
+        std::exception_ptr error;
+        std::mutex mtx;
+        std::condition_variable cond;
+    };
+    auto state=std::make_shared<State>();
+    state->count=chunkCount;
+    //body只在领取到块时调用，而调用线程会一直等到所有块完成，所以引用调用方的body是安全的
+    state->body=[&body](std::size_t i){ body(i); };
+
+    auto work=[](State& st){
+        for(;;){
+            std::size_t i=st.next.fetch_add(1);
+            if(i>=st.count)
+                return;
+            try{
+                st.body(i);
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(st.mtx);
+                if(!st.error)
+                    st.error=std::current_exception();
+            }
+            if(st.done.fetch_add(1)+1==st.count){
+                std::lock_guard<std::mutex> lock(st.mtx);
+                st.cond.notify_all();
+            }
+        }
+    };
+
+    std::size_t helpers=std::min<std::size_t>(std::max(0,pool.getThreadSize()),chunkCount-1);
+    for(std::size_t i=0;i<helpers;++i){
+        pool.post([state,work](){ work(*state); });
+    }
+    work(*state);
+
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->cond.wait(lock,[&]()->bool{ return state->done==state->count; });
+    if(state->error)
+        std::rethrow_exception(state->error);
+}
+
+//并行变换：out[i]=fn(first[i])
+template<typename InputIt,typename OutputIt,typename Func>
+OutputIt parallelTransform(ThreadPool& pool,InputIt first,InputIt last,OutputIt out,Func fn)
+{
+    using T=typename std::iterator_traits<InputIt>::value_type;
+    std::size_t n=std::distance(first,last);
+    std::size_t grain=parallelGrainSize<T>(pool,n);
+    std::size_t chunks=(n+grain-1)/grain;
+    parallelChunks(pool,chunks,[&](std::size_t c){
+        std::size_t begin=c*grain;
+        std::size_t end=std::min(n,begin+grain);
+        std::transform(first+begin,first+end,out+begin,fn);
+    });
+    return out+n;
+}
+
+//并行查找第一个满足pred的元素，找不到返回last
+//已找到更靠前的元素后，后面的块直接跳过，正在扫描的块也会提前退出
+template<typename RandomIt,typename Pred>
+RandomIt parallelFindIf(ThreadPool& pool,RandomIt first,RandomIt last,Pred pred)
+{
+    using T=typename std::iterator_traits<RandomIt>::value_type;
+    std::size_t n=std::distance(first,last);
+    std::size_t grain=parallelGrainSize<T>(pool,n);
+    std::size_t chunks=(n+grain-1)/grain;
+    std::atomic_size_t found(n); //目前找到的最小下标
+
+    parallelChunks(pool,chunks,[&](std::size_t c){
+        std::size_t begin=c*grain;
+        std::size_t end=std::min(n,begin+grain);
+        for(std::size_t i=begin;i<end;i+=PARALLEL_MIN_GRAIN){
+            //前面的块已经找到结果，本块不可能更靠前
+            if(found.load(std::memory_order_relaxed)<i)
+                return;
+            std::size_t stop=std::min(end,i+PARALLEL_MIN_GRAIN);
+            for(std::size_t j=i;j<stop;++j){
+                if(pred(first[j])){
+                    std::size_t cur=found.load();
+                    while(j<cur && !found.compare_exchange_weak(cur,j)){}
+                    return;
+                }
+            }
+        }
+    });
+    return first+found.load();
+}
+
+//并行前缀和(三趟)：1.各块求和 2.串行计算各块的起始值 3.各块带起始值重新扫描
+//op需要满足结合律；out可以与first相同(原地计算)
+//inclusive=true：out[i]=first[0]op...op first[i]
+//inclusive=false：out[i]=init op first[0]op...op first[i-1]
+template<typename InputIt,typename OutputIt,typename T,typename BinaryOp>
+OutputIt parallelScanImpl(ThreadPool& pool,InputIt first,InputIt last,OutputIt out,
+                          bool inclusive,const T* init,BinaryOp op)
+{
+    std::size_t n=std::distance(first,last);
+    if(n==0)
+        return out;
+    std::size_t grain=parallelGrainSize<T>(pool,n);
+    std::size_t chunks=(n+grain-1)/grain;
+
+    //第一趟：每块的归约值
+    std::vector<T> sums(chunks);
+    parallelChunks(pool,chunks,[&](std::size_t c){
+        std::size_t begin=c*grain;
+        std::size_t end=std::min(n,begin+grain);
+        T acc=first[begin];
+        for(std::size_t i=begin+1;i<end;++i){
+            acc=op(acc,first[i]);
+        }
+        sums[c]=acc;
+    });
+
+    //第二趟：各块的起始值（块数很少，串行即可）
+    std::vector<T> offsets(chunks);
+    std::vector<char> hasOffset(chunks,0);
+    bool hasAcc=(init!=nullptr);
+    T acc=hasAcc?*init:T();
+    for(std::size_t c=0;c<chunks;++c){
+        if(hasAcc){
+            offsets[c]=acc;
+            hasOffset[c]=1;
+            acc=op(acc,sums[c]);
+        }
+        else{
+            acc=sums[c];
+            hasAcc=true;
+        }
+    }
+
+    //第三趟：带起始值重新扫描每块
+    parallelChunks(pool,chunks,[&](std::size_t c){
+        std::size_t begin=c*grain;
+        std::size_t end=std::min(n,begin+grain);
+        std::size_t i=begin;
+        T acc=T();
+        if(hasOffset[c]){
+            acc=offsets[c];
+        }
+        else{
+            //没有起始值：只会出现在inclusive扫描的第一块
+            acc=first[i];
+            out[i]=acc;
+            ++i;
+        }
+        for(;i<end;++i){
+            if(inclusive){
+                acc=op(acc,first[i]);
+                out[i]=acc;
+            }
+            else{
+                T cur=first[i]; //先取出输入，支持原地计算
+                out[i]=acc;
+                acc=op(acc,cur);
+            }
+        }
+    });
+    return out+n;
+}
+
+template<typename InputIt,typename OutputIt,typename BinaryOp=std::plus<>>
+OutputIt parallelInclusiveScan(ThreadPool& pool,InputIt first,InputIt last,OutputIt out,BinaryOp op=BinaryOp())
+{
+    using T=typename std::iterator_traits<InputIt>::value_type;
+    return parallelScanImpl<InputIt,OutputIt,T>(pool,first,last,out,true,nullptr,op);
+}
+
+template<typename InputIt,typename OutputIt,typename T,typename BinaryOp=std::plus<>>
+OutputIt parallelExclusiveScan(ThreadPool& pool,InputIt first,InputIt last,OutputIt out,T init,BinaryOp op=BinaryOp())
+{
+    return parallelScanImpl<InputIt,OutputIt,T>(pool,first,last,out,false,&init,op);
+}
+
+//并行归并排序(稳定)：
+//1.按缓存大小切块，各块并行std::stable_sort
+//2.逐轮两两归并；每对有序段再按二分查找切成若干互不相关的小段并行归并，最后几轮也能用满所有线程
+//要求：T可默认构造、可移动赋值
+template<typename RandomIt,typename Compare=std::less<>>
+void parallelSort(ThreadPool& pool,RandomIt first,RandomIt last,Compare comp=Compare())
+{
+    using T=typename std::iterator_traits<RandomIt>::value_type;
+    std::size_t n=std::distance(first,last);
+    std::size_t grain=parallelGrainSize<T>(pool,n);
+    std::size_t chunks=(n+grain-1)/grain;
+    if(chunks<=1){
+        std::stable_sort(first,last,comp);
+        return;
+    }
+
+    //第一步：块内排序
+    parallelChunks(pool,chunks,[&](std::size_t c){
+        std::size_t begin=c*grain;
+        std::size_t end=std::min(n,begin+grain);
+        std::stable_sort(first+begin,first+end,comp);
+    });
+
+    //第二步：逐轮归并，数据在原数组与缓冲区之间来回搬运
+    //不拷贝输入：第一轮归并直接从原数组写入buffer，省掉一次O(n)的串行拷贝
+    //new T[n]是默认初始化，基础类型不会被逐个清零
+    std::unique_ptr<T[]> buffer(new T[n]);
+    bool inBuffer=false; //当前有序数据是否在buffer中
+    std::size_t targetPieces=(std::max(1,pool.getThreadSize())+1)*4;
+
+    //一个可独立执行的归并片段：[a0,a1)与[b0,b1)归并到out开始的位置
+    struct Piece
+    {
+        std::size_t a0,a1,b0,b1,out;
+    };
+
+    for(std::size_t width=grain;width<n;width*=2){
+        auto src=[&](std::size_t i)->T&{ return inBuffer?buffer[i]:first[i]; };
+        std::size_t pairs=(n+2*width-1)/(2*width);
+        std::size_t piecesPerPair=std::max<std::size_t>(1,targetPieces/pairs);
+
+        std::vector<Piece> pieces;
+        for(std::size_t p=0;p<pairs;++p){
+            std::size_t a0=p*2*width;
+            std::size_t a1=std::min(n,a0+width);
+            std::size_t b0=a1;
+            std::size_t b1=std::min(n,a0+2*width);
+            //按较长的一段等分切点，在另一段中二分查找对应位置，保持稳定性
+            std::size_t lastA=a0,lastB=b0;
+            for(std::size_t k=1;k<piecesPerPair && b0<b1;++k){
+                std::size_t splitA,splitB;
+                if(a1-a0>=b1-b0){
+                    splitA=a0+(a1-a0)*k/piecesPerPair;
+                    std::size_t lo=b0,hi=b1; //lower_bound：b中严格小于src(splitA)的元素
+                    while(lo<hi){
+                        std::size_t mid=lo+(hi-lo)/2;
+                        if(comp(src(mid),src(splitA))) lo=mid+1; else hi=mid;
+                    }
+                    splitB=lo;
+                }
+                else{
+                    splitB=b0+(b1-b0)*k/piecesPerPair;
+                    std::size_t lo=a0,hi=a1; //upper_bound：a中不大于src(splitB)的元素
+                    while(lo<hi){
+                        std::size_t mid=lo+(hi-lo)/2;
+                        if(!comp(src(splitB),src(mid))) lo=mid+1; else hi=mid;
+                    }
+                    splitA=lo;
+                }
+                if(splitA<lastA || splitB<lastB) continue;
+                pieces.push_back({lastA,splitA,lastB,splitB,lastA+(lastB-b0)});
+                lastA=splitA;
+                lastB=splitB;
+            }
+            pieces.push_back({lastA,a1,lastB,b1,lastA+(lastB-b0)});
+        }
+
+        parallelChunks(pool,pieces.size(),[&](std::size_t i){
+            const Piece& pc=pieces[i];
+            if(inBuffer){
+                std::merge(std::make_move_iterator(buffer.get()+pc.a0),std::make_move_iterator(buffer.get()+pc.a1),
+                           std::make_move_iterator(buffer.get()+pc.b0),std::make_move_iterator(buffer.get()+pc.b1),
+                           first+pc.out,comp);
+            }
+            else{
+                std::merge(std::make_move_iterator(first+pc.a0),std::make_move_iterator(first+pc.a1),
+                           std::make_move_iterator(first+pc.b0),std::make_move_iterator(first+pc.b1),
+                           buffer.get()+pc.out,comp);
+            }
+        });
+        inBuffer=!inBuffer;
+    }
+
+    if(inBuffer){
+        parallelTransform(pool,buffer.get(),buffer.get()+n,first,[](T& v)->T{ return std::move(v); });
+    }
+}
+
+#endif
@@ -0,0 +1,407 @@
+#ifndef PIPELINE_FINAL_H
+#define PIPELINE_FINAL_H
+
+#include<vector>
+#include<map>
+#include<memory>
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+#include<any>
+#include<exception>
+#include<type_traits>
+#include<iterator>
+#include "threadpool_final.h"
+
+const std::size_t PIPELINE_MAX_TOKENS =64; //流水线中同时存在的数据项(token)上限
+const int PIPELINE_STAGE_BATCH =32; //一个stage任务连续处理的token数，超过后重新排队，把线程让给其它stage
+
+//流水线阶段的执行方式
+enum class StageMode
+{
+    PARALLEL,            //多个线程并行处理(并行度可设置)
+    SERIAL_IN_ORDER,     //同一时刻只有一个线程处理，且按输入顺序处理
+    SERIAL_OUT_OF_ORDER, //同一时刻只有一个线程处理，顺序不保证
+};
+
+//有界无锁通道(多生产者多消费者环形队列)：每个槽位带一个序号，生产者/消费者只靠CAS推进下标
+template<typename T>
+class BoundedChannel{
+public:
+    explicit BoundedChannel(std::size_t capacity)
+    {
+        std::size_t size=2;
+        while(size<capacity)
+            size*=2;
+        mask_=size-1;
+        cells_.reset(new Cell[size]);
+        for(std::size_t i=0;i<size;++i){
+            cells_[i].seq_.store(i,std::memory_order_relaxed);
+        }
+        enqueuePos_.store(0,std::memory_order_relaxed);
+        dequeuePos_.store(0,std::memory_order_relaxed);
+    }
+
+    //队列满时返回false
+    bool tryPush(T&& value)
+    {
+        Cell* cell;
+        std::size_t pos=enqueuePos_.load(std::memory_order_relaxed);
+        for(;;){
+            cell=&cells_[pos&mask_];
+            std::size_t seq=cell->seq_.load(std::memory_order_acquire);
+            std::intptr_t dif=(std::intptr_t)seq-(std::intptr_t)pos;
+            if(dif==0){
+                if(enqueuePos_.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }
+            else if(dif<0){
+                return false;
+            }
+            else{
+                pos=enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data_=std::move(value);
+        cell->seq_.store(pos+1,std::memory_order_release);
+        return true;
+    }
+
+    //队列空时返回false
+    bool tryPop(T& value)
+    {
+        Cell* cell;
+        std::size_t pos=dequeuePos_.load(std::memory_order_relaxed);
+        for(;;){
+            cell=&cells_[pos&mask_];
+            std::size_t seq=cell->seq_.load(std::memory_order_acquire);
+            std::intptr_t dif=(std::intptr_t)seq-(std::intptr_t)(pos+1);
+            if(dif==0){
+                if(dequeuePos_.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }
+            else if(dif<0){
+                return false;
+            }
+            else{
+                pos=dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        value=std::move(cell->data_);
+        cell->seq_.store(pos+mask_+1,std::memory_order_release);
+        return true;
+    }
+
+    BoundedChannel(const BoundedChannel&)=delete;
+    BoundedChannel& operator=(const BoundedChannel&)=delete;
+
+private:
+    struct Cell
+    {
+        std::atomic_size_t seq_;
+        T data_;
+    };
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+    alignas(64) std::atomic_size_t enqueuePos_; //生产者与消费者的下标放在不同的缓存行
+    alignas(64) std::atomic_size_t dequeuePos_;
+};
+
+//从stage函数的签名中推导参数与返回值类型(普通函数、函数指针、非泛型lambda/函数对象)
+template<typename F>
+struct StageTraits: StageTraits<decltype(&F::operator())>{};
+template<typename R,typename A>
+struct StageTraits<R(*)(A)>{ using Arg=std::decay_t<A>; using Ret=R; };
+template<typename R,typename A>
+struct StageTraits<R(A)>: StageTraits<R(*)(A)>{};
+template<typename C,typename R,typename A>
+struct StageTraits<R(C::*)(A)>: StageTraits<R(*)(A)>{};
+template<typename C,typename R,typename A>
+struct StageTraits<R(C::*)(A) const>: StageTraits<R(*)(A)>{};
+
+/*
+多阶段流水线：ingest -> parse -> transform -> write
+1.每个stage有自己的执行方式(并行/串行有序/串行无序)，stage之间用有界无锁通道连接
+2.流水线中同时存在的token数不超过maxTokens(通道容量不小于它，所以入队不会失败)：下游慢时token堆积在下游，
+  输入端拿不到token就停下来，反压自然传递到源头
+3.stage不独占线程：通道中有数据且并行度未满时向线程池投递一个stage任务，由池内任意线程执行
+
+example:
+Pipeline pipeline(pool);
+pipeline.addStage(StageMode::PARALLEL,[](std::string line){ return parse(line); })
+        .addStage(StageMode::PARALLEL,[](Record r){ return transform(r); },4)
+        .addStage(StageMode::SERIAL_IN_ORDER,[&](Record r){ writer.write(r); });
+pipeline.run(lines.begin(),lines.end());
+*/
+class Pipeline{
+public:
+    explicit Pipeline(ThreadPool& pool,std::size_t maxTokens=PIPELINE_MAX_TOKENS)
+        : impl_(std::make_shared<Impl>(pool,maxTokens>0?maxTokens:1))
+    {}
+
+    //添加一个stage：fn接收上一stage的输出(第一个stage接收输入)，最后一个stage可以返回void
+    //parallelism只对PARALLEL有效，<=0时为线程池的线程数
+    template<typename Func>
+    Pipeline& addStage(StageMode mode,Func fn,int parallelism=0)
+    {
+        using Arg=typename StageTraits<Func>::Arg;
+        using Ret=typename StageTraits<Func>::Ret;
+
+        auto stage=std::make_unique<Stage>(impl_->maxTokens_);
+        stage->mode_=mode;
+        if(mode==StageMode::PARALLEL)
+            stage->limit_=parallelism>0?parallelism:std::max(1,impl_->pool_.getThreadSize());
+        else
+            stage->limit_=1;
+        stage->fn_=[fn](std::any& in) mutable ->std::any{
+            Arg* arg=std::any_cast<Arg>(&in);
+            if(arg==nullptr)
+                throw std::bad_any_cast();
+            if constexpr(std::is_void<Ret>::value){
+                fn(std::move(*arg));
+                return std::any();
+            }
+            else{
+                return std::any(fn(std::move(*arg)));
+            }
+        };
+        impl_->stages_.push_back(std::move(stage));
+        return *this;
+    }
+
+    //输入来自迭代器区间[first,last)，所有数据流过全部stage后返回；stage抛出的第一个异常在这里重新抛出
+    template<typename InputIt>
+    void run(InputIt first,InputIt last)
+    {
+        using In=typename std::iterator_traits<InputIt>::value_type;
+        runGenerate<In>([&](In& in)->bool{
+            if(first==last)
+                return false;
+            in=*first;
+            ++first;
+            return true;
+        });
+    }
+
+    //输入来自生成器：gen(in)返回false表示输入结束
+    template<typename In,typename Gen>
+    void runGenerate(Gen gen)
+    {
+        Impl& impl=*impl_;
+        if(impl.stages_.empty())
+            return;
+        impl.error_=nullptr;
+        impl.failed_=false;
+        for(auto& stage:impl.stages_){
+            stage->nextSeq_=0;
+        }
+
+        std::size_t seq=0;
+        for(;;){
+            //反压：token用完时等待下游完成
+            {
+                std::unique_lock<std::mutex> lock(impl.mtx_);
+                if(impl.inflight_>=impl.maxTokens_){
+                    lock.unlock();
+                    ThreadPool::BlockingRegion region;
+                    lock.lock();
+                    impl.tokenCond_.wait(lock,[&]()->bool{ return impl.inflight_<impl.maxTokens_; });
+                }
+                if(impl.failed_)
+                    break;
+                impl.inflight_++; //先占用一个token
+            }
+            //gen或In的拷贝/移动可能抛异常：归还token并记录异常，等已在流水线中的token流出后再抛出
+            //(否则token永远不归还，之后再调用run()会一直等在tokenCond_上)
+            Token token;
+            try{
+                In in;
+                if(!gen(in)){
+                    std::lock_guard<std::mutex> lock(impl.mtx_);
+                    impl.inflight_--;
+                    break;
+                }
+                token.value_=std::any(std::move(in));
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(impl.mtx_);
+                impl.inflight_--;
+                if(!impl.error_)
+                    impl.error_=std::current_exception();
+                impl.failed_=true;
+                break;
+            }
+            token.seq_=seq++;
+            impl.push(impl_,0,std::move(token));
+        }
+
+        //等待所有token流出流水线
+        {
+            std::unique_lock<std::mutex> lock(impl.mtx_);
+            if(impl.inflight_>0){
+                lock.unlock();
+                ThreadPool::BlockingRegion region;
+                lock.lock();
+                impl.tokenCond_.wait(lock,[&]()->bool{ return impl.inflight_==0; });
+            }
+        }
+        if(impl.error_)
+            std::rethrow_exception(impl.error_);
+    }
+
+    Pipeline(const Pipeline&)=delete;
+    Pipeline& operator=(const Pipeline&)=delete;
+
+private:
+    //流水线中的一个数据项
+    struct Token
+    {
+        std::size_t seq_=0; //输入序号(串行有序stage按它排序)
+        std::any value_;
+        bool failed_=false; //上游stage抛了异常：不再执行后续stage，只是为了让有序stage的序号连续
+    };
+
+    struct Stage
+    {
+        explicit Stage(std::size_t capacity):channel_(capacity){}
+        StageMode mode_=StageMode::PARALLEL;
+        int limit_=1; //并行度
+        std::function<std::any(std::any&)> fn_;
+        BoundedChannel<Token> channel_; //输入通道
+        std::atomic_int queued_{0}; //通道中的token数
+        std::atomic_int active_{0}; //正在执行该stage的任务数
+        //以下只由串行stage的唯一执行者访问(active_的CAS保证可见性)
+        std::map<std::size_t,Token> pending_; //乱序到达、还没轮到的token
+        std::size_t nextSeq_=0; //下一个应处理的序号
+    };
+
+    //流水线状态：stage任务持有shared_ptr，run()返回后仍在收尾的任务也不会访问已释放的内存
+    struct Impl
+    {
+        Impl(ThreadPool& pool,std::size_t maxTokens)
+            : pool_(pool)
+            , maxTokens_(maxTokens)
+            , inflight_(0)
+            , failed_(false)
+        {}
+
+        //token进入第index个stage的通道，必要时投递stage任务
+        void push(const std::shared_ptr<Impl>& self,std::size_t index,Token&& token)
+        {
+            Stage& stage=*stages_[index];
+            //流水线中的token总数不超过maxTokens_，而通道容量不小于maxTokens_，所以这里不会失败
+            stage.channel_.tryPush(std::move(token));
+            stage.queued_.fetch_add(1);
+            schedule(self,index);
+        }
+
+        //并行度未满时占用一个名额并投递stage任务
+        void schedule(const std::shared_ptr<Impl>& self,std::size_t index)
+        {
+            Stage& stage=*stages_[index];
+            int active=stage.active_.load();
+            while(active<stage.limit_){
+                if(stage.active_.compare_exchange_weak(active,active+1)){
+                    pool_.post([self,index](){ self->runStage(self,index); });
+                    return;
+                }
+            }
+        }
+
+        //取出下一个可以处理的token
+        bool next(Stage& stage,Token& token)
+        {
+            if(stage.mode_!=StageMode::SERIAL_IN_ORDER){
+                if(!stage.channel_.tryPop(token))
+                    return false;
+                stage.queued_.fetch_sub(1);
+                return true;
+            }
+            //有序stage：把通道中的token都搬进pending_，按序号取
+            Token arrived;
+            while(stage.channel_.tryPop(arrived)){
+                stage.queued_.fetch_sub(1);
+                std::size_t seq=arrived.seq_;
+                stage.pending_.emplace(seq,std::move(arrived));
+            }
+            auto it=stage.pending_.find(stage.nextSeq_);
+            if(it==stage.pending_.end())
+                return false;
+            token=std::move(it->second);
+            stage.pending_.erase(it);
+            stage.nextSeq_++;
+            return true;
+        }
+
+        void runStage(const std::shared_ptr<Impl>& self,std::size_t index)
+        {
+            Stage& stage=*stages_[index];
+            for(;;){
+                Token token;
+                int processed=0;
+                while(processed<PIPELINE_STAGE_BATCH && next(stage,token)){
+                    process(self,index,std::move(token));
+                    processed++;
+                }
+                if(processed==PIPELINE_STAGE_BATCH){
+                    //可能还有数据：保留名额重新排队，让其它stage也有机会执行
+                    pool_.post([self,index](){ self->runStage(self,index); });
+                    return;
+                }
+                //释放名额后再检查一次通道：防止生产者看到名额已满而没有投递任务，数据却无人处理
+                stage.active_.fetch_sub(1);
+                if(stage.queued_.load()==0)
+                    return;
+                int active=stage.active_.load();
+                bool acquired=false;
+                while(active<stage.limit_){
+                    if(stage.active_.compare_exchange_weak(active,active+1)){
+                        acquired=true;
+                        break;
+                    }
+                }
+                if(!acquired)
+                    return;
+            }
+        }
+
+        void process(const std::shared_ptr<Impl>& self,std::size_t index,Token&& token)
+        {
+            if(!token.failed_){
+                try{
+                    token.value_=stages_[index]->fn_(token.value_);
+                }
+                catch(...){
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if(!error_)
+                        error_=std::current_exception();
+                    failed_=true; //输入端不再产生新token
+                    token.failed_=true;
+                    token.value_.reset();
+                }
+            }
+            if(index+1<stages_.size()){
+                push(self,index+1,std::move(token));
+                return;
+            }
+            //token流出流水线，归还名额
+            std::lock_guard<std::mutex> lock(mtx_);
+            inflight_--;
+            tokenCond_.notify_all();
+        }
+
+        ThreadPool& pool_;
+        std::size_t maxTokens_;
+        std::vector<std::unique_ptr<Stage>> stages_;
+        std::size_t inflight_; //流水线中的token数
+        std::mutex mtx_;
+        std::condition_variable tokenCond_;
+        std::exception_ptr error_;
+        bool failed_;
+    };
+
+    std::shared_ptr<Impl> impl_;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef STREAM_FINAL_H
+#define STREAM_FINAL_H
+
+#include<vector>
+#include<memory>
+#include<mutex>
+#include<condition_variable>
+#include<optional>
+#include<exception>
+#include<utility>
+#include<iterator>
+#include "threadpool_final.h"
+
+const std::size_t ORDERED_MAP_WINDOW =64; //默认同时在执行中的任务数
+
+/*
+有序流式map：输入逐个取出交给线程池处理，结果按输入顺序交给sink
+1.以前的做法：先提交全部任务拿到vector<future>，再按顺序get()——所有future和结果同时驻留内存，队头任务慢时后面的结果也只能干等
+2.这里最多只有window个任务在执行中，结果写入大小为window的“重排序缓冲区”，队头结果就绪就立即交给sink并补充一个新输入
+  内存占用恒定，输入、计算、输出流水线进行
+3.在线程池线程中调用时，等待结果的过程被BlockingRegion包住，不会因占用线程而死锁
+
+example:
+std::vector<std::string> lines=...;
+orderedMap(pool,lines.begin(),lines.end(),
+    [](const std::string& line){ return parse(line); },
+    [&](Record r){ writer.write(r); });
+
+//输入来自生成器：gen(in)返回false表示输入结束
+orderedMapGenerate<std::string>(pool,[&](std::string& line){ return (bool)std::getline(file,line); },
+    [](const std::string& line){ return parse(line); },
+    [&](Record r){ writer.write(r); });
+*/
+template<typename In,typename Gen,typename Func,typename Sink>
+void orderedMapGenerate(ThreadPool& pool,Gen gen,Func fn,Sink sink,std::size_t window=ORDERED_MAP_WINDOW)
+{
+    using Out=decltype(fn(std::declval<In&>()));
+    if(window==0)
+        window=1;
+
+    //重排序缓冲区中的一个槽位
+    struct Slot
+    {
+        std::optional<Out> value_;
+        std::exception_ptr error_;
+        bool ready_=false;
+    };
+    //共享状态由任务共同持有：sink或fn抛异常提前返回时，仍在执行的任务也不会访问已释放的内存
+    struct State
+    {
+        State(Func f,std::size_t n):fn_(std::move(f)),slots_(n){}
+        Func fn_;
+        std::vector<Slot> slots_;
+        std::mutex mtx_;
+        std::condition_variable ready_;
+    };
+    auto state=std::make_shared<State>(std::move(fn),window);
+
+    std::size_t submitted=0; //已提交的输入个数
+    std::size_t emitted=0; //已交给sink的结果个数
+    bool more=true; //输入是否还有剩余
+
+    for(;;){
+        //补满窗口：槽位submitted%window对应的旧结果一定已经交给sink
+        while(more && submitted-emitted<window){
+            In in;
+            if(!gen(in)){
+                more=false;
+                break;
+            }
+            std::size_t index=submitted%window;
+            pool.post([state,index,in=std::move(in)]() mutable {
+                std::optional<Out> value;
+                std::exception_ptr error;
+                try{
+                    value.emplace(state->fn_(in));
+                }
+                catch(...){
+                    error=std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(state->mtx_);
+                Slot& slot=state->slots_[index];
+                slot.value_=std::move(value);
+                slot.error_=error;
+                slot.ready_=true;
+                state->ready_.notify_all();
+            });
+            ++submitted;
+        }
+        if(emitted==submitted)
+            break;
+
+        //按输入顺序取出队头结果
+        Slot& head=state->slots_[emitted%window];
+        std::optional<Out> value;
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(state->mtx_);
+            if(!head.ready_){
+                lock.unlock();
+                ThreadPool::BlockingRegion region;
+                lock.lock();
+                state->ready_.wait(lock,[&]()->bool{ return head.ready_; });
+            }
+            value=std::move(head.value_);
+            error=head.error_;
+            head.value_.reset();
+            head.error_=nullptr;
+            head.ready_=false;
+        }
+        ++emitted;
+        if(error)
+            std::rethrow_exception(error);
+        sink(std::move(*value));
+    }
+}
+
+//输入来自迭代器区间[first,last)
+template<typename InputIt,typename Func,typename Sink>
+void orderedMap(ThreadPool& pool,InputIt first,InputIt last,Func fn,Sink sink,std::size_t window=ORDERED_MAP_WINDOW)
+{
+    using In=typename std::iterator_traits<InputIt>::value_type;
+    orderedMapGenerate<In>(pool,[&](In& in)->bool{
+        if(first==last)
+            return false;
+        in=*first;
+        ++first;
+        return true;
+    },std::move(fn),std::move(sink),window);
+}
+
+#endif
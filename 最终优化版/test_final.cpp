@@ -1,5 +1,12 @@
 #include<iostream>
+#include<map>
+#include<set>
 #include "threadpool_final.h"
+#include "parallel_final.h"
+#include "typed_threadpool_final.h"
+#include "stream_final.h"
+#include "pipeline_final.h"
+#include "async_io_final.h"
 using namespace std;
 
 int sum1(int a,int b){
@@ -13,6 +20,440 @@ int sum2(int a,int b,int c)
     return a+b+c;
 }
 
+//同一个Strand上的任务按提交顺序串行执行
+void testStrand(ThreadPool& pool){
+    auto strand=pool.makeStrand();
+    vector<int> order;
+    int running=0;
+    bool overlap=false;
+    for(int i=0;i<100;i++){
+        strand->post([&,i](){
+            if(++running>1) overlap=true;
+            order.push_back(i);
+            --running;
+        });
+    }
+    future<int> r=strand->submitTask([&]()->int{ return (int)order.size(); });
+    int taskCount=r.get(); //之前投递的任务都已执行完
+    bool inOrder=true;
+    for(int i=0;i<(int)order.size();i++){
+        if(order[i]!=i) inOrder=false;
+    }
+    cout<<"strand tasks="<<taskCount<<" inOrder="<<inOrder<<" overlap="<<overlap<<endl;
+}
+
+//两个租户按权重1:3分配线程
+void testTaskGroup(){
+    ThreadPool pool;
+    int noisy=pool.addTaskGroup(1,64);
+    int quiet=pool.addTaskGroup(3,64);
+    vector<int> order;
+    mutex mtx;
+    vector<future<void>> results;
+    for(int i=0;i<40;i++){
+        results.push_back(pool.submitTaskToGroup(noisy,[&](){ lock_guard<mutex> lock(mtx); order.push_back(noisy); }));
+        results.push_back(pool.submitTaskToGroup(quiet,[&](){ lock_guard<mutex> lock(mtx); order.push_back(quiet); }));
+    }
+    pool.start(1);
+    for(auto& r:results) r.get();
+    int quietCount=0;
+    for(int i=0;i<40;i++){
+        if(order[i]==quiet) quietCount++;
+    }
+    cout<<"task group: quiet tasks in first 40="<<quietCount<<endl;
+}
+
+//并行算法的结果与串行算法一致
+void testParallel(ThreadPool& pool){
+    vector<int> v(1000000);
+    for(int i=0;i<(int)v.size();i++){
+        v[i]=(int)((i*7919LL)%100003);
+    }
+    vector<int> expect=v;
+    sort(expect.begin(),expect.end());
+    parallelSort(pool,v.begin(),v.end());
+    cout<<"parallelSort ok="<<(v==expect)<<endl;
+
+    vector<long long> in(v.begin(),v.end()),out(in.size());
+    parallelInclusiveScan(pool,in.begin(),in.end(),out.begin());
+    vector<long long> exOut(in.size());
+    parallelExclusiveScan(pool,in.begin(),in.end(),exOut.begin(),0LL);
+    long long acc=0;
+    bool scanOk=true;
+    for(size_t i=0;i<in.size();i++){
+        if(exOut[i]!=acc) scanOk=false;
+        acc+=in[i];
+        if(out[i]!=acc) scanOk=false;
+    }
+    cout<<"parallelScan ok="<<scanOk<<endl;
+
+    parallelTransform(pool,in.begin(),in.end(),out.begin(),[](long long x){ return x*2; });
+    auto it=parallelFindIf(pool,out.begin(),out.end(),[](long long x){ return x>=100000; });
+    cout<<"parallelFindIf ok="<<(it==find_if(out.begin(),out.end(),[](long long x){ return x>=100000; }))<<endl;
+}
+
+struct Sum2{
+    int operator()(int a,int b) const { return a+b; }
+};
+
+//只执行一种任务的线程池：结果直接写入预分配的槽位
+void testTypedPool(){
+    TypedThreadPool<Sum2,int,int,int> pool;
+    pool.start(2);
+    vector<int> results(100);
+    for(int i=0;i<100;i++){
+        pool.submitTask(&results[i],i,i);
+    }
+    pool.wait();
+    bool ok=true;
+    for(int i=0;i<100;i++){
+        if(results[i]!=2*i) ok=false;
+    }
+
+    //任务抛出的异常由wait()重新抛出，线程池继续可用
+    struct Throwing{
+        int operator()(int x) const { if(x==3) throw runtime_error("bad"); return x; }
+    };
+    TypedThreadPool<Throwing,int,int> throwing;
+    throwing.start(2);
+    vector<int> out(10);
+    for(int i=0;i<10;i++){
+        throwing.submitTask(&out[i],i);
+    }
+    bool caught=false;
+    try{
+        throwing.wait();
+    }
+    catch(const runtime_error&){
+        caught=true;
+    }
+    cout<<"typed pool ok="<<ok<<" exception rethrown="<<caught<<endl;
+}
+
+//阻塞任务执行期间由补偿线程继续处理CPU任务，阻塞结束后补偿线程退出
+void testBlockingTask(){
+    ThreadPool pool;
+    pool.setTaskQuemaxThreshHold(16);
+    pool.start(1);
+    auto begin=chrono::steady_clock::now();
+    future<int> io=pool.submitBlockingTask([](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        return 1;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    future<int> cpu=pool.submitTask([](int a,int b){ return a+b; },1,2);
+    cpu.get();
+    auto cpuMs=chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-begin).count();
+    int threadsDuringBlock=pool.getThreadSize();
+    io.get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    cout<<"blocking task: cpu task not delayed="<<(cpuMs<400)
+        <<" threads during block="<<threadsDuringBlock
+        <<" threads after="<<pool.getThreadSize()<<endl;
+
+    //阻塞任务与其后的任务被同一个线程批量取出：后面的任务应交给补偿线程，而不是等阻塞结束
+    ThreadPool batched;
+    batched.setTaskQuemaxThreshHold(16);
+    auto blockBegin=chrono::steady_clock::now();
+    future<int> blocked=batched.submitBlockingTask([](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        return 1;
+    });
+    vector<future<int>> behind;
+    for(int i=0;i<4;i++){
+        behind.push_back(batched.submitTask([](int x){ return x; },i));
+    }
+    batched.start(1); //启动前入队：唯一的线程一次取出全部5个任务
+    for(auto& r:behind) r.get();
+    auto behindMs=chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-blockBegin).count();
+    blocked.get();
+    cout<<"blocking task: batched tasks not delayed="<<(behindMs<400)<<endl;
+
+    //嵌套的阻塞区域只补偿一个线程
+    ThreadPool nested;
+    nested.setTaskQuemaxThreshHold(16);
+    nested.start(1);
+    future<int> inner=nested.submitBlockingTask([&nested](){
+        ThreadPool::BlockingRegion region;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return nested.getThreadSize();
+    });
+    int nestedThreads=inner.get();
+    cout<<"blocking task: nested regions threads="<<nestedThreads<<endl;
+}
+
+//运行中调整线程数量，排队的任务不会丢失
+void testResize(){
+    ThreadPool pool;
+    pool.setTaskQuemaxThreshHold(4);
+    pool.start(1);
+    pool.setQueueCapacity(64);
+    atomic_int done(0);
+    vector<future<void>> results;
+    for(int i=0;i<32;i++){
+        results.push_back(pool.submitTask([&done](){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            done++;
+        }));
+    }
+    pool.resize(4);
+    int grown=pool.getThreadSize();
+    pool.resize(2);
+    for(auto& r:results) r.get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    cout<<"resize: grown="<<grown<<" shrunk="<<pool.getThreadSize()<<" done="<<done<<endl;
+}
+
+//有序流式map：慢任务在前，结果仍按输入顺序输出
+void testOrderedMap(ThreadPool& pool){
+    vector<int> in(200);
+    for(int i=0;i<200;i++) in[i]=i;
+    vector<int> out;
+    orderedMap(pool,in.begin(),in.end(),[](int x){
+        if(x%50==0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return x*x;
+    },[&](int y){ out.push_back(y); },8);
+    bool ok=out.size()==in.size();
+    for(size_t i=0;ok && i<out.size();i++){
+        if(out[i]!=in[i]*in[i]) ok=false;
+    }
+    cout<<"orderedMap ok="<<ok<<endl;
+}
+
+//三级流水线：并行解析 -> 并行变换 -> 串行有序写出
+void testPipeline(ThreadPool& pool){
+    vector<string> lines;
+    for(int i=0;i<500;i++) lines.push_back(to_string(i));
+    vector<int> written;
+    Pipeline pipeline(pool,16);
+    pipeline.addStage(StageMode::PARALLEL,[](string line){ return stoi(line); })
+            .addStage(StageMode::PARALLEL,[](int x){ return x*2; })
+            .addStage(StageMode::SERIAL_IN_ORDER,[&](int x){ written.push_back(x); });
+    pipeline.run(lines.begin(),lines.end());
+    bool ok=written.size()==lines.size();
+    for(size_t i=0;ok && i<written.size();i++){
+        if(written[i]!=(int)i*2) ok=false;
+    }
+
+    //输入端抛异常：run()重新抛出，token全部归还，同一个Pipeline可以再次运行
+    int count=0;
+    Pipeline again(pool,4);
+    again.addStage(StageMode::PARALLEL,[](int x){ return x; })
+         .addStage(StageMode::SERIAL_IN_ORDER,[&](int){ count++; });
+    bool thrown=false;
+    try{
+        int next=0;
+        again.runGenerate<int>([&](int& x)->bool{
+            if(next==10) throw runtime_error("gen");
+            x=next++;
+            return true;
+        });
+    }
+    catch(const runtime_error&){
+        thrown=true;
+    }
+    vector<int> small(20,1);
+    again.run(small.begin(),small.end());
+    cout<<"pipeline ok="<<ok<<" gen exception="<<thrown<<" rerun="<<(count==30)<<endl;
+}
+
+//同一个key的任务落在同一个线程上
+void testSubmitWithKey(){
+    ThreadPool pool;
+    pool.setTaskQuemaxThreshHold(64);
+    pool.start(4); //start()返回时本地队列已经分配好，不需要等线程启动
+    map<int,set<thread::id>> threadsOfKey;
+    mutex mtx;
+    vector<future<void>> results;
+    for(int i=0;i<40;i++){
+        int key=i%4;
+        results.push_back(pool.submitWithKey(key,[&,key](){
+            lock_guard<mutex> lock(mtx);
+            threadsOfKey[key].insert(this_thread::get_id());
+        }));
+        //不积压：保证不会触发窃取
+        results.back().wait();
+    }
+    bool sticky=true;
+    for(auto& kv:threadsOfKey){
+        if(kv.second.size()!=1) sticky=false;
+    }
+    cout<<"submitWithKey sticky="<<sticky<<endl;
+
+    //默认队列上限(TASK_MAX_THRESHHOLD)：同一个key积压时其余任务被空闲线程窃取或退回默认任务组，不会提交失败
+    ThreadPool small;
+    small.start(4);
+    auto begin=chrono::steady_clock::now();
+    future<int> slow=small.submitWithKey(1,[](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        return 0;
+    });
+    vector<future<int>> behind;
+    for(int i=1;i<=4;i++){
+        behind.push_back(small.submitWithKey(1,[](int x){ return x; },i));
+    }
+    int sum=0;
+    for(auto& r:behind) sum+=r.get();
+    auto behindMs=chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-begin).count();
+    slow.get();
+    cout<<"submitWithKey overload sum="<<sum<<" not delayed="<<(behindMs<400)<<endl;
+
+    //本地队列所属线程进入阻塞区域：排在后面的同key任务由补偿线程窃取执行
+    ThreadPool blocking;
+    blocking.setTaskQuemaxThreshHold(16);
+    blocking.start(1);
+    auto blockBegin=chrono::steady_clock::now();
+    //key取0：补偿线程加入后本地队列变为2个，key 0仍然落在阻塞线程的队列上
+    future<int> blocked=blocking.submitWithKey(0,[](){
+        ThreadPool::BlockingRegion region;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        return 0;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    future<int> queued=blocking.submitWithKey(0,[](int x){ return x; },1);
+    queued.get();
+    auto queuedMs=chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-blockBegin).count();
+    blocked.get();
+    cout<<"submitWithKey behind blocked owner not delayed="<<(queuedMs<400)<<endl;
+
+    //cached模式：按key提交的积压任务同样会让线程池扩容
+    ThreadPool cached;
+    cached.setMode(PoolMode::MODE_CACHED);
+    cached.setTaskQuemaxThreshHold(16);
+    cached.start(1);
+    vector<future<void>> keyed;
+    for(int i=0;i<4;i++){
+        keyed.push_back(cached.submitWithKey(0,[](){
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }));
+    }
+    int grown=cached.getThreadSize();
+    for(auto& r:keyed) r.get();
+    cout<<"submitWithKey cached grown="<<(grown>1)<<endl;
+}
+
+//同一个key同时提交多次只计算一次
+void testSubmitOnce(ThreadPool& pool){
+    atomic_int calls(0);
+    auto compute=[&calls](int x){
+        calls++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return x*10;
+    };
+    shared_future<int> f1=pool.submitOnce("key",compute,1);
+    shared_future<int> f2=pool.submitOnce("key",compute,1);
+    bool shared=f1.get()==10 && f2.get()==10 && calls==1;
+    //结果缓存1秒：完成后再次提交直接命中缓存
+    shared_future<int> f3=pool.submitOnce("cached",std::chrono::milliseconds(1000),compute,2);
+    f3.get();
+    shared_future<int> f4=pool.submitOnce("cached",std::chrono::milliseconds(1000),compute,2);
+    bool cached=f4.get()==20 && calls==2;
+    //大量不同key的缓存过期后，下一次提交时被清理，登记表不会无限增长
+    vector<shared_future<int>> many;
+    for(int i=0;i<100;i++){
+        many.push_back(pool.submitOnce("many"+to_string(i),std::chrono::milliseconds(20),[](int x){ return x; },i));
+    }
+    for(auto& f:many) f.get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    pool.submitOnce("last",[](){ return 0; }).get();
+    bool swept=pool.getOnceTaskSize()<=2; //只剩"cached"(缓存1秒)与可能还没来得及删除登记的"last"
+    cout<<"submitOnce shared="<<shared<<" cached="<<cached<<" swept="<<swept<<endl;
+}
+
+//异步写入再读回临时文件：io_uring与线程退化实现结果一致
+void testAsyncIO(ThreadPool& pool){
+    char path[]="/tmp/threadpool_async_io_XXXXXX";
+    int fd=mkstemp(path);
+    if(fd<0){
+        cout<<"async io: mkstemp fail"<<endl;
+        return;
+    }
+    unlink(path);
+    for(bool useIoUring:{true,false}){
+        AsyncFileIO io(pool,64,useIoUring);
+        vector<string> blocks;
+        vector<future<ssize_t>> writes;
+        for(int i=0;i<16;i++){
+            blocks.push_back(string(4096,(char)('a'+i)));
+        }
+        for(int i=0;i<16;i++){
+            writes.push_back(io.write(fd,blocks[i].data(),blocks[i].size(),(off_t)i*4096));
+        }
+        bool ok=true;
+        for(auto& w:writes){
+            if(w.get()!=4096) ok=false;
+        }
+        vector<string> readBack(16,string(4096,'\0'));
+        atomic_int done(0);
+        atomic_bool readOk(true);
+        promise<void> allDone;
+        for(int i=0;i<16;i++){
+            io.asyncRead(fd,&readBack[i][0],4096,(off_t)i*4096,[&](ssize_t n){
+                if(n!=4096) readOk=false;
+                if(++done==16) allDone.set_value();
+            });
+        }
+        allDone.get_future().wait();
+        ok=ok && readOk && readBack==blocks;
+        cout<<"async io("<<(io.usingIoUring()?"io_uring":"threads")<<") ok="<<ok<<endl;
+    }
+    close(fd);
+}
+
+//多个组件共用默认线程池：每个任务区同时执行的任务数不超过各自的上限
+void testTaskArena(){
+    ThreadPool& pool=ThreadPool::defaultPool();
+    bool shared=&pool==&ThreadPool::defaultPool();
+    auto arenaA=pool.makeArena(1);
+    auto arenaB=pool.makeArena(2);
+    atomic_int runningA(0),runningB(0),maxA(0),maxB(0);
+    auto body=[](atomic_int& running,atomic_int& maxRunning){
+        int now=++running;
+        int old=maxRunning;
+        while(now>old && !maxRunning.compare_exchange_weak(old,now)){}
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        --running;
+    };
+    vector<future<void>> results;
+    for(int i=0;i<50;i++){
+        results.push_back(arenaA->submitTask(body,std::ref(runningA),std::ref(maxA)));
+        results.push_back(arenaB->submitTask(body,std::ref(runningB),std::ref(maxB)));
+    }
+    for(auto& r:results) r.get();
+    cout<<"task arena: shared pool="<<shared<<" capA ok="<<(maxA<=1)<<" capB ok="<<(maxB<=2)<<endl;
+
+    //上限为1的任务区中嵌套提交并等待：等待放在BlockingRegion中让出名额，否则嵌套任务排在等待者之后永远不会执行
+    future<int> outer=arenaA->submitTask([arenaA](){
+        future<int> inner=arenaA->submitTask(sum1,3,4);
+        ThreadPool::BlockingRegion region;
+        return inner.get()+1;
+    });
+    bool nestedOk=outer.wait_for(std::chrono::seconds(5))==std::future_status::ready && outer.get()==8;
+    cout<<"task arena nested: ok="<<nestedOk<<" cap="<<arenaA->getMaxConcurrency()<<endl;
+}
+
+//性能分析模式(make test_final_profile)：统计各调用位置的锁等待/持有时间与唤醒延迟
+void testProfile(){
+    ThreadPool pool;
+    pool.setMode(PoolMode::MODE_CACHED);
+    pool.setTaskQuemaxThreshHold(256);
+    pool.start(2);
+    vector<future<int>> results;
+    for(int i=0;i<200;i++){
+        results.push_back(pool.submitTask([](int x){ return x+1; },i));
+        if(i%50==0) std::this_thread::sleep_for(std::chrono::milliseconds(5)); //让线程进入等待，产生唤醒
+    }
+    for(auto& r:results) r.get();
+#ifdef THREADPOOL_PROFILE
+    bool ok=false;
+    for(auto& site:pool.getLockProfile()){
+        if(site.first==LockSite::SUBMIT && site.second.hold_.count_>=200) ok=true;
+    }
+    cout<<"profile ok="<<ok<<endl;
+#endif
+    cout<<pool.getProfileReport();
+}
+
 int main(){
     ThreadPool pool;
     pool.start(2);
@@ -31,5 +472,18 @@ int main(){
     cout<<"r1="<<r1.get()<<" "<<"r2="<<r2.get()<<endl;
     cout<<"sum="<<r3.get()<<endl;
     cout<<r4.get()<<" "<<r5.get()<<endl;
+    testStrand(pool);
+    testTaskGroup();
+    testParallel(pool);
+    testTypedPool();
+    testBlockingTask();
+    testResize();
+    testOrderedMap(pool);
+    testPipeline(pool);
+    testSubmitWithKey();
+    testSubmitOnce(pool);
+    testAsyncIO(pool);
+    testTaskArena();
+    testProfile();
     return 0;
 }
\ No newline at end of file
@@ -13,10 +13,144 @@
 #include<functional>  //bind()
 #include<thread>
 #include<future>
+#include<algorithm>
+#include<fstream>
+#include<string>
+#include<any>
+#include<cstdint>
+#include<sstream>
+#include<iomanip>
 
 const int TASK_MAX_THRESHHOLD =2; //任务数量阈值
 const int THREAD_MAX_THRESHHOLD =100; //线程数量阈值
 const int THread_MAX_IDLE_TIME =60; //单位：秒（s）
+const int TASK_MAX_BATCH =16; //线程一次加锁最多取出的任务数
+const int AFFINITY_STEAL_THRESHHOLD =4; //某线程本地队列中的任务数超过该值才允许其它线程窃取(队列上限较小时取上限-1)
+const int DEFAULT_POOL_QUE_THRESHHOLD =1024; //进程级默认线程池的任务队列阈值
+const int CACHE_LINE_SIZE =64; //缓存行大小(字节)：频繁修改的共享数据按它对齐，避免伪共享
+const int COUNTER_SHARDS =16; //分片计数器的分片数
+
+//每个任务都会经过的调试输出：默认关闭，定义THREADPOOL_DEBUG后打开（小任务场景下cout本身就是瓶颈）
+#ifdef THREADPOOL_DEBUG
+#define THREADPOOL_LOG(msg) (std::cout<<msg<<std::endl)
+#else
+#define THREADPOOL_LOG(msg) ((void)0)
+#endif
+
+//锁的调用位置(性能分析模式按位置分别统计taskQueMtx_的等待与持有时间)
+enum class LockSite
+{
+    SUBMIT,   //提交任务(submitTask/submitWithKey/post)
+    DEQUEUE,  //线程取任务
+    SPAWN,    //创建线程(cached模式下在提交者持锁期间进行，同时计入SUBMIT的持有时间)与新线程启动
+    SHUTDOWN, //析构时通知并等待线程退出
+    CONTROL,  //resize、阻塞区域、任务组设置等
+    COUNT
+};
+
+//性能分析模式：默认关闭，定义THREADPOOL_PROFILE后统计锁的等待/持有时间与空闲线程的唤醒延迟
+//关闭时锁仍是std::unique_lock、条件变量仍是std::condition_variable，没有任何额外开销
+#ifdef THREADPOOL_PROFILE
+const int PROFILE_BUCKETS =40; //耗时直方图的桶数：第i个桶记录[2^i,2^(i+1))纳秒
+
+//一类耗时的统计：次数、总和、最大值与log2直方图(用于估算p99)
+//只在持有taskQueMtx_时修改，不需要原子操作
+struct LatencyStats
+{
+    std::uint64_t count_=0;
+    std::uint64_t totalNs_=0;
+    std::uint64_t maxNs_=0;
+    std::uint64_t buckets_[PROFILE_BUCKETS]={};
+
+    void record(std::uint64_t ns)
+    {
+        count_++;
+        totalNs_+=ns;
+        maxNs_=std::max(maxNs_,ns);
+        int bucket=63-__builtin_clzll(ns|1);
+        buckets_[std::min(bucket,PROFILE_BUCKETS-1)]++;
+    }
+
+    double avgUs() const
+    {
+        return count_==0?0:totalNs_/1000.0/count_;
+    }
+
+    //百分位数(取所在桶的上界，最多高估一倍)
+    double percentileUs(double p) const
+    {
+        std::uint64_t rank=(std::uint64_t)(count_*p);
+        std::uint64_t seen=0;
+        for(int i=0;i<PROFILE_BUCKETS;++i){
+            seen+=buckets_[i];
+            if(seen>rank)
+                return std::min<double>((double)(2ull<<i),(double)maxNs_)/1000.0;
+        }
+        return maxNs_/1000.0;
+    }
+};
+
+//一个调用位置的统计：等待锁的时间与持有锁的时间
+struct LockSiteProfile
+{
+    LatencyStats wait_;
+    LatencyStats hold_;
+};
+
+//性能分析用的锁：用法与std::unique_lock相同，加锁时记录等待时间，解锁时记录持有时间
+//配合std::condition_variable_any使用：条件变量等待期间会经过unlock()/lock()，等待条件的时间不计入持有时间
+class ProfiledLock
+{
+public:
+    ProfiledLock(std::mutex& mtx,LockSiteProfile& profile)
+        : mtx_(mtx)
+        , profile_(profile)
+        , owns_(false)
+        , lockedNs_(0)
+    {
+        lock();
+    }
+    ~ProfiledLock()
+    {
+        if(owns_)
+            unlock();
+    }
+
+    void lock()
+    {
+        std::uint64_t begin=now();
+        mtx_.lock();
+        lockedNs_=now();
+        owns_=true;
+        profile_.wait_.record(lockedNs_-begin);
+    }
+    void unlock()
+    {
+        profile_.hold_.record(now()-lockedNs_);
+        owns_=false;
+        mtx_.unlock();
+    }
+    bool owns_lock() const
+    {
+        return owns_;
+    }
+
+    static std::uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    ProfiledLock(const ProfiledLock&)=delete;
+    ProfiledLock& operator=(const ProfiledLock&)=delete;
+
+private:
+    std::mutex& mtx_;
+    LockSiteProfile& profile_;
+    bool owns_;
+    std::uint64_t lockedNs_;
+};
+#endif
 
 enum class PoolMode
 {
@@ -57,11 +191,53 @@ public:
     }
 private:
     ThreadFunc func_;
-    static int generateId_; //确保每个线程id不同，用一个”静态成员“即可(类外初始化)
+    static std::atomic_int generateId_; //确保每个线程id不同，用一个”静态成员“即可(类外初始化)；多个线程池可能同时创建线程，需为原子类型
     int threadId_; //保存线程id
 };
 
-int Thread::generateId_=0;
+std::atomic_int Thread::generateId_(0);
+
+class Strand;
+class TaskArena;
+
+/*
+ShardedCounter(分片计数器):
+1.每个线程执行每批任务前后都要修改idleThreadSize_，所有核心反复争抢同一个缓存行
+2.分片计数器把计数拆成COUNTER_SHARDS份，每份独占一个缓存行，线程只修改自己id对应的分片，读取时才把各分片相加
+适用于修改频繁、读取很少的计数；读到的只是某一时刻附近的近似值
+*/
+class ShardedCounter{
+public:
+    ShardedCounter()
+    {
+        for(Shard& shard:shards_){
+            shard.value_.store(0,std::memory_order_relaxed);
+        }
+    }
+
+    //修改第shard个分片(一般传线程id)
+    void add(int shard,long delta)
+    {
+        shards_[(unsigned)shard%COUNTER_SHARDS].value_.fetch_add(delta,std::memory_order_relaxed);
+    }
+
+    //汇总各分片
+    long load() const
+    {
+        long sum=0;
+        for(const Shard& shard:shards_){
+            sum+=shard.value_.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Shard
+    {
+        std::atomic_long value_;
+    };
+    Shard shards_[COUNTER_SHARDS];
+};
 
 
 /*
@@ -84,21 +260,42 @@ pool.submitTask(std::shared_ptr<MyTask>());
 class ThreadPool{
 public:
     ThreadPool()
-        : initThreadSize_(0)
-        , curThreadSize_(0)
-        , idleThreadSize_(0)
+        : poolMode_(PoolMode::MODE_FIXED)
+        , isPoolRunning_(false)
+        , initThreadSize_(0)
         , threadSizeThreshHold_(THREAD_MAX_THRESHHOLD)
+        , taskBatchSize_(TASK_MAX_BATCH)
+        , detectCpuQuota_(false)
+        , curThreadSize_(0)
+        , blockedThreadSize_(0)
+        , compensateThreadSize_(0)
+        , retireThreadSize_(0)
+        , drrCursor_(0)
         , taskSize_(0)
-        , taskQueMaxThreshHold_(TASK_MAX_THRESHHOLD)
-        , poolMode_(PoolMode::MODE_FIXED)
-        , isPoolRunning_(false)
-    {}
+        , affinityTaskSize_(0)
+    {
+        //0号任务组：submitTask()/post()默认使用的队列
+        taskGroups_.emplace_back(1,TASK_MAX_THRESHHOLD);
+    }
+
+private:
+    struct DefaultPoolTag{};
+    //defaultPool()专用：队列阈值放大，按CPU配额启动
+    explicit ThreadPool(DefaultPoolTag)
+        : ThreadPool()
+    {
+        taskGroups_[0].capacity_=DEFAULT_POOL_QUE_THRESHHOLD;
+        detectCpuQuota_=true;
+        start();
+    }
+
+public:
 
     ~ThreadPool()
     {
         isPoolRunning_=false;
 
-        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        auto lock=lockTaskQue(LockSite::SHUTDOWN);
         notEmpty_.notify_all();
     
         exitCond_.wait(lock,[&]()->bool{return threads_.size()==0;});
@@ -117,7 +314,7 @@ public:
     {
         if(checkRunningState())
             return;
-        taskQueMaxThreshHold_=threshhold;
+        taskGroups_[0].capacity_=threshhold;
     }
 
     void setThreadSizeThreshHold(int threshhold){
@@ -132,12 +329,90 @@ public:
     
 
 
+    //start()不指定线程数量时，是否按容器的cgroup CPU配额决定线程数量(默认按hardware_concurrency())
+    void setDetectCpuQuota(bool detect)
+    {
+        if(checkRunningState())
+            return;
+        detectCpuQuota_=detect;
+    }
+
+    //运行中调整线程数量：多出的线程执行完手头任务后退出，不会丢弃已排队的任务；不足则立即创建
+    void resize(int threadSize)
+    {
+        if(!checkRunningState() || threadSize<=0)
+            return;
+        auto lock=lockTaskQue(LockSite::CONTROL);
+        initThreadSize_=threadSize;
+        threadSizeThreshHold_=std::max(threadSizeThreshHold_,threadSize);
+
+        //阻塞区域的补偿线程不计入目标，它们在阻塞结束后自行退出
+        int target=threadSize+compensateThreadSize_;
+        int active=curThreadSize_-retireThreadSize_;
+        if(target>active){
+            //先撤销等待中的退出，再创建新线程
+            int revoke=std::min(retireThreadSize_,target-active);
+            retireThreadSize_-=revoke;
+            for(int i=active+revoke;i<target;++i){
+                addThreadLocked();
+            }
+        }
+        else if(target<active){
+            retireThreadSize_+=active-target;
+            notEmpty_.notify_all(); //唤醒空闲线程让它们退出
+        }
+    }
+
+    //运行中调整默认任务队列(0号任务组)的上限
+    void setQueueCapacity(int capacity)
+    {
+        auto lock=lockTaskQue(LockSite::CONTROL);
+        taskGroups_[0].capacity_=capacity;
+        notFull_.notify_all(); //容量变大时唤醒等待中的提交者
+    }
+
+    //设置线程一次加锁最多取出的任务数(为1时退化为每次取一个任务)
+    void setTaskBatchSize(int batchSize)
+    {
+        if(checkRunningState())
+            return;
+        taskBatchSize_=batchSize>0?batchSize:1;
+    }
+
+    //添加一个任务组(租户)，返回组id
+    //weight：权重，负载过高时各组按权重比例分配线程  capacity：该组任务队列上限
+    //各组的队列互相独立，某个租户填满自己的队列不会挤占其它租户的空间
+    int addTaskGroup(int weight,int capacity=TASK_MAX_THRESHHOLD)
+    {
+        auto lock=lockTaskQue(LockSite::CONTROL);
+        taskGroups_.emplace_back(weight>0?weight:1,capacity);
+        return (int)taskGroups_.size()-1;
+    }
+
+    //修改任务组的权重与队列上限(运行中也可以修改)
+    void setTaskGroup(int groupId,int weight,int capacity)
+    {
+        auto lock=lockTaskQue(LockSite::CONTROL);
+        if(groupId<0 || groupId>=(int)taskGroups_.size())
+            return;
+        taskGroups_[groupId].weight_=weight>0?weight:1;
+        taskGroups_[groupId].capacity_=capacity;
+        notFull_.notify_all();
+    }
+
     //给线程池提交任务
     //使用可变参模板编程，让SubmitTask可以接收任意任务函数和任意数量的参数
     //返回值future<>但不知道具体类型怎么办？
     // Result submitTask(std::shared_ptr<Task> sp);
     template<typename Func,typename... Args>  //Func：函数类型   Args...:参数包 
     auto submitTask(Func&& func,Args&&... args)->std::future<decltype(func(args...))>
+    {
+        return submitTaskToGroup(0,std::forward<Func>(func),std::forward<Args>(args)...);
+    }
+
+    //给指定任务组提交任务
+    template<typename Func,typename... Args>
+    auto submitTaskToGroup(int groupId,Func&& func,Args&&... args)->std::future<decltype(func(args...))>
     {
         //打包任务，放入任务队列
         using RType=decltype(func(args...));
@@ -146,54 +421,297 @@ public:
                     std::bind(std::forward<Func>(func),std::forward<Args>(args)...));
         std::future<RType> result=task->get_future();
         
-        //获取锁
-        std::unique_lock<std::mutex> lock(taskQueMtx_);
-        //条件不满足，最多阻塞1秒，超过1秒则提交失败
-        if(!notFull_.wait_for(lock,std::chrono::seconds(1),[&]()
-            ->bool{ return taskQue_.size()<taskQueMaxThreshHold_;}))
+        if(!enqueueTask(groupId,[task](){ (*task)(); }))
         {
-            //notFull_等待1秒，条件还是不满足
-            std::cerr<<"task queue is full,submit task fail."<<std::endl;
-            
             //任务提交失败，通过packaged_task创建一个临时“函数对象”，配合get_future返回一个RType类型的默认值RType()
             auto task=std::make_shared<std::packaged_task<RType()>>([]()->RType{ return RType();});
             (*task)();
             return task->get_future();
         }
-        //如果有空余，把任务放入任务队列中
-        taskQue_.emplace([task](){ (*task)(); });
+        return result;
+    }
+
+    //单飞(single-flight)提交：同一个key的任务还在排队或执行时，直接返回已有计算的shared_future，不再重复提交
+    //cacheTtl>0时，任务完成后结果再缓存cacheTtl时长，期间同key的提交直接拿到缓存结果
+    //同一个key必须对应同一种返回值类型，否则抛出std::bad_any_cast
+    template<typename Func,typename... Args>
+    auto submitOnce(const std::string& key,Func&& func,Args&&... args)->std::shared_future<decltype(func(args...))>
+    {
+        return submitOnce(key,std::chrono::milliseconds(0),std::forward<Func>(func),std::forward<Args>(args)...);
+    }
+
+    template<typename Func,typename... Args>
+    auto submitOnce(const std::string& key,std::chrono::milliseconds cacheTtl,Func&& func,Args&&... args)
+        ->std::shared_future<decltype(func(args...))>
+    {
+        using RType=decltype(func(args...));
+        std::uint64_t generation;
+        std::shared_ptr<std::promise<RType>> promise;
+        std::shared_future<RType> result;
+        {
+            std::unique_lock<std::mutex> lock(onceMtx_);
+            sweepExpiredOnceLocked();
+            auto it=onceTasks_.find(key);
+            if(it!=onceTasks_.end()){
+                OnceEntry& entry=it->second;
+                //缓存过期的结果丢弃，重新计算
+                if(!entry.done_ || std::chrono::steady_clock::now()<entry.expire_)
+                    return std::any_cast<std::shared_future<RType>>(entry.future_);
+                onceTasks_.erase(it);
+            }
+            promise=std::make_shared<std::promise<RType>>();
+            generation=++onceGeneration_;
+            result=promise->get_future().share();
+            OnceEntry& entry=onceTasks_[key];
+            entry.future_=result;
+            entry.generation_=generation;
+        }
+
+        auto bound=std::bind(std::forward<Func>(func),std::forward<Args>(args)...);
+        bool ok=enqueueTask(0,[this,key,cacheTtl,generation,promise,bound]() mutable {
+            try{
+                if constexpr(std::is_void<RType>::value){
+                    bound();
+                    promise->set_value();
+                }
+                else{
+                    promise->set_value(bound());
+                }
+            }
+            catch(...){
+                promise->set_exception(std::current_exception());
+            }
+            finishOnce(key,cacheTtl,generation);
+        });
+
+        if(!ok){
+            //提交失败：与submitTask一致返回RType()，并去掉登记，后面的提交可以重试
+            if constexpr(std::is_void<RType>::value)
+                promise->set_value();
+            else
+                promise->set_value(RType());
+            finishOnce(key,std::chrono::milliseconds(0),generation);
+        }
+        return result;
+    }
+
+    //按key提交任务：同一个key的任务总是进入同一个线程的本地队列，该key的数据可以一直留在这个线程所在核的缓存中
+    //只有当那个线程积压超过窃取阈值(见affinityStealThreshholdLocked())个任务(或已经退出)时，其它线程才会窃取
+    //本地队列达到队列上限时任务退回默认任务组
+    //注意：线程数量变化(resize/cached模式扩容)后key与线程的对应关系会改变
+    template<typename Key,typename Func,typename... Args>
+    auto submitWithKey(const Key& key,Func&& func,Args&&... args)->std::future<decltype(func(args...))>
+    {
+        using RType=decltype(func(args...));
+        auto task=std::make_shared<std::packaged_task<RType()>>(
+                    std::bind(std::forward<Func>(func),std::forward<Args>(args)...));
+        std::future<RType> result=task->get_future();
+
+        auto lock=lockTaskQue(LockSite::SUBMIT);
+        if(affinityQues_.empty()){
+            //还没有线程：放入默认任务组
+            lock.unlock();
+            post([task](){ (*task)(); });
+            return result;
+        }
+        std::size_t slot=std::hash<Key>()(key)%affinityQues_.size();
+        if(affinityQues_[slot].que_.size()>=taskGroups_[0].capacity_){
+            //本地队列已满(该线程积压严重)：放弃亲和性，退回默认任务组由任意线程执行；默认组也满时与submitTask一样等待/失败
+            lock.unlock();
+            if(!enqueueTask(0,[task](){ (*task)(); }))
+            {
+                auto task=std::make_shared<std::packaged_task<RType()>>([]()->RType{ return RType();});
+                (*task)();
+                return task->get_future();
+            }
+            return result;
+        }
+        affinityQues_[slot].que_.emplace([task](){ (*task)(); });
+        affinityTaskSize_++;
+        //目标线程可能正在等待，其它线程也可能可以窃取
+        markNotifyLocked();
+        notEmpty_.notify_all();
+
+        //cached模式：按key提交的任务同样参与扩容判断，新线程通过窃取分担积压或阻塞线程的本地队列
+        addThreadIfNeeded();
+        return result;
+    }
+
+    //投递一个无返回值的内部任务：不受任务队列阈值限制，不会提交失败
+    //Strand等组件的“续作任务”依赖它，若提交失败会导致已排队的任务永远得不到执行
+    void post(std::function<void()> task)
+    {
+        auto lock=lockTaskQue(LockSite::SUBMIT);
+        taskGroups_[0].que_.emplace(std::move(task));
         taskSize_++;
-        //因为有新任务，任务队列肯定不空，在notEmpty_上进行通知,分配线程执行任务
+        markNotifyLocked();
         notEmpty_.notify_all();
 
-        //cached模式：任务处理比较紧急  场景：小而快的任务， 需要根据任务数量和空闲线程的数量，判断是否需要增加/删除线程
-        if(poolMode_==PoolMode::MODE_CACHED //线程池工作在cached模式
-            && taskSize_>idleThreadSize_      //任务数量大于空闲线程数量
-            && curThreadSize_<threadSizeThreshHold_)  //当前线程池内线程数量小于线程数量阈值
+        addThreadIfNeeded();
+    }
+
+    //阻塞区域守卫：在任务中用它包住文件I/O、等锁等会阻塞的代码
+    //进入时若“未阻塞的线程数”低于initThreadSize_，线程池会唤醒或创建一个补偿线程，保证执行CPU任务的线程数不变；
+    //离开时多出来的补偿线程在执行完手头任务后退出。不在线程池线程中使用时什么也不做
+    class BlockingRegion
+    {
+    public:
+        //定义在TaskArena之后：阻塞期间还要让出当前线程占用的任务区名额
+        BlockingRegion();
+        ~BlockingRegion();
+        BlockingRegion(const BlockingRegion&)=delete;
+        BlockingRegion& operator=(const BlockingRegion&)=delete;
+    private:
+        ThreadPool* pool_;
+        TaskArena* arena_; //当前线程正在执行其任务的任务区，没有则为nullptr
+    };
+
+    //提交一个整体都会阻塞的任务(相当于在任务外面包一层BlockingRegion)
+    template<typename Func,typename... Args>
+    auto submitBlockingTask(Func&& func,Args&&... args)->std::future<decltype(func(args...))>
+    {
+        auto bound=std::bind(std::forward<Func>(func),std::forward<Args>(args)...);
+        return submitTask([bound]() mutable ->decltype(func(args...)){
+            BlockingRegion region;
+            return bound();
+        });
+    }
+
+    //当前登记的单飞任务数(排队、执行中与结果缓存中的key)
+    std::size_t getOnceTaskSize()
+    {
+        std::unique_lock<std::mutex> lock(onceMtx_);
+        return onceTasks_.size();
+    }
+
+    //获取当前线程池中的线程数量
+    int getThreadSize() const
+    {
+        return curThreadSize_;
+    }
+
+    //性能分析报告(需定义THREADPOOL_PROFILE)：各调用位置按总耗时(等待+持有)从高到低排列，
+    //列出taskQueMtx_的等待/持有时间(平均、p99、最大，单位us)，以及空闲线程的唤醒延迟
+    std::string getProfileReport()
+    {
+#ifdef THREADPOOL_PROFILE
+        static const char* siteNames[]={"submit","dequeue","spawn","shutdown","control"};
+        std::vector<std::pair<LockSite,LockSiteProfile>> sites=getLockProfile();
+        LatencyStats wakeup=getWakeupProfile();
+        std::ostringstream os;
+        os<<std::fixed<<std::setprecision(2);
+        os<<"site      count     wait(avg/p99/max us)          hold(avg/p99/max us)\n";
+        for(auto& site:sites){
+            const LatencyStats& w=site.second.wait_;
+            const LatencyStats& h=site.second.hold_;
+            os<<std::left<<std::setw(10)<<siteNames[(int)site.first]<<std::setw(10)<<std::max(w.count_,h.count_)
+              <<w.avgUs()<<"/"<<w.percentileUs(0.99)<<"/"<<w.maxNs_/1000.0<<"    "
+              <<h.avgUs()<<"/"<<h.percentileUs(0.99)<<"/"<<h.maxNs_/1000.0<<"\n";
+        }
+        os<<"wakeup    "<<std::setw(10)<<wakeup.count_
+          <<wakeup.avgUs()<<"/"<<wakeup.percentileUs(0.99)<<"/"<<wakeup.maxNs_/1000.0<<" us\n";
+        return os.str();
+#else
+        return "profiling disabled (define THREADPOOL_PROFILE)\n";
+#endif
+    }
+
+#ifdef THREADPOOL_PROFILE
+    //各调用位置的锁统计，按总耗时(等待+持有)从高到低排列
+    std::vector<std::pair<LockSite,LockSiteProfile>> getLockProfile()
+    {
+        std::vector<std::pair<LockSite,LockSiteProfile>> sites;
         {
-            std::cout<<"create new thread: "<<std::this_thread::get_id()<<std::endl;
+            //读取统计本身不计入任何调用位置
+            std::unique_lock<std::mutex> lock(taskQueMtx_);
+            for(int i=0;i<(int)LockSite::COUNT;++i){
+                sites.emplace_back((LockSite)i,lockProfile_[i]);
+            }
+        }
+        std::sort(sites.begin(),sites.end(),[](const auto& a,const auto& b){
+            return a.second.wait_.totalNs_+a.second.hold_.totalNs_>b.second.wait_.totalNs_+b.second.hold_.totalNs_;
+        });
+        return sites;
+    }
 
-            // 创建新线程对象
-            auto ptr=std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc,this,std::placeholders::_1));
-            //threads_.emplace_back(std::move(ptr));
-            int threadId=ptr->getId();
-                //注意：emplace与insert不同，emplace是以初值安插，insert是以拷贝安插
-            threads_.emplace(threadId,std::move(ptr));
-            //启动线程
-            threads_[threadId]->start();
-            //修改线程数量相关变量 
-            curThreadSize_++;
-            idleThreadSize_++;
+    //空闲线程从被通知到重新持有锁的延迟
+    LatencyStats getWakeupProfile()
+    {
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        return wakeupProfile_;
+    }
+
+    //清空统计(例如预热结束后)
+    void resetProfile()
+    {
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        for(LockSiteProfile& profile:lockProfile_){
+            profile=LockSiteProfile();
         }
+        wakeupProfile_=LatencyStats();
+    }
+#endif
 
-        return result;
+    //创建一个串行执行器：投递到同一个Strand的任务按FIFO顺序、互不重叠地执行，但可借用池内任意线程
+    std::shared_ptr<Strand> makeStrand();
+
+    //创建一个并发上限为maxConcurrency的任务区(<=0时为当前线程数量)：投递到任务区的任务最多同时占用这么多个池内线程
+    std::shared_ptr<TaskArena> makeArena(int maxConcurrency=0);
+
+    //进程级默认线程池：第一次调用时按defaultThreadSize()(参考cgroup配额)启动，进程退出时回收
+    //各组件共用它(或它上面的TaskArena)，而不是各自start()一个内核数量的线程池
+    static ThreadPool& defaultPool()
+    {
+        static ThreadPool pool(DefaultPoolTag{});
+        return pool;
+    }
+
+    //默认线程数量：内核数量；开启setDetectCpuQuota()后不超过cgroup CPU配额
+    int defaultThreadSize() const
+    {
+        int threadSize=std::max(1u,std::thread::hardware_concurrency());
+        if(detectCpuQuota_){
+            int quota=cgroupCpuQuota();
+            if(quota>0)
+                threadSize=std::min(threadSize,quota);
+        }
+        return threadSize;
+    }
+
+    //读取cgroup CPU配额(向上取整的核数)，没有限制或读取失败返回0
+    static int cgroupCpuQuota()
+    {
+        long long quota=-1,period=0;
+        //cgroup v2：cpu.max内容为"$MAX $PERIOD"，不限制时$MAX为"max"
+        std::ifstream v2("/sys/fs/cgroup/cpu.max");
+        if(v2){
+            std::string max;
+            v2>>max>>period;
+            if(max!="max" && !max.empty())
+                quota=std::stoll(max);
+        }
+        else{
+            //cgroup v1：cfs_quota_us为-1表示不限制
+            std::ifstream q("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+            std::ifstream p("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            if(q && p){
+                q>>quota;
+                p>>period;
+            }
+        }
+        if(quota<=0 || period<=0)
+            return 0;
+        return (int)((quota+period-1)/period);
     }
 
     //开启线程池(参数为初始线程数量,默认为4)
     //void start(int initThreadSize=4);
-    //开启线程池(参数为初始线程数量,默认为"内核数量")
-    void start(int initThreadSize=std::thread::hardware_concurrency())
+    //开启线程池(参数为初始线程数量,不指定(<=0)时为defaultThreadSize())
+    void start(int initThreadSize=0)
     {
+        if(initThreadSize<=0)
+            initThreadSize=defaultThreadSize();
+
         //线程池启动
         isPoolRunning_=true;
 
@@ -201,8 +719,9 @@ public:
         initThreadSize_=initThreadSize;
         curThreadSize_=initThreadSize_;
 
-        //此次线程池线程的起始threadId(避免同时启动多个线程池出现错误)
-        int firstThreadId=Thread::getGenerateId();
+        //记录此次创建的线程id：其它线程池可能同时在创建线程，id不一定连续
+        std::vector<int> threadIds;
+        threadIds.reserve(initThreadSize_);
 
         // 创建线程对象
         for(int i=0;i<initThreadSize_;++i){
@@ -212,16 +731,24 @@ public:
             //unique_ptr不可拷贝，只能”右值引用 move“
             //threads_.emplace_back(ptr);不行——>unique_ptr的”拷贝构造函数“=delete，在传入时会隐式调用其拷贝构造函数，故不行
             int threadId=ptr->getId();
+            threadIds.push_back(threadId);
             //注意：emplace与insert不同，emplace是以初值安插，insert是以拷贝安插
             threads_.emplace(threadId,std::move(ptr));
         }
 
+        //在启动线程之前为每个线程分配本地队列：start()返回时本地队列的数量已经确定，
+        //之后submitWithKey提交的key与线程的对应关系不会因为线程启动先后而变化
+        {
+            auto lock=lockTaskQue(LockSite::SPAWN);
+            for(int threadId:threadIds){
+                claimAffinitySlotLocked(threadId);
+            }
+        }
+
         // 启动所有线程（与创建分开，让线程启动公平）
-        for(int i=0;i<initThreadSize_;++i){
-            //要提前记录firstThreadId，避免一个项目中启动多个线程池出现错误
-            int threadId=firstThreadId+i;
+        for(int threadId:threadIds){
             threads_[threadId]->start();
-            idleThreadSize_++; //空闲线程数量+1：只是启动，还未分配任务
+            idleThreadSize_.add(threadId,1); //空闲线程数量+1：只是启动，还未分配任务
         }
     }
 
@@ -230,35 +757,104 @@ public:
     ThreadPool& operator=(const ThreadPool&) = delete;
 
 private:
+    //性能分析模式下锁与条件变量换成可统计耗时的版本
+#ifdef THREADPOOL_PROFILE
+    using PoolCondition=std::condition_variable_any;
+    ProfiledLock lockTaskQue(LockSite site)
+    {
+        return ProfiledLock(taskQueMtx_,lockProfile_[(int)site]);
+    }
+#else
+    using PoolCondition=std::condition_variable;
+    std::unique_lock<std::mutex> lockTaskQue(LockSite)
+    {
+        return std::unique_lock<std::mutex>(taskQueMtx_);
+    }
+#endif
+
+    //以下三个函数只在性能分析模式下有内容（调用方需持有taskQueMtx_）
+    //有线程在等待时发出通知：记下时刻，由第一个被唤醒的线程计算唤醒延迟
+    void markNotifyLocked()
+    {
+#ifdef THREADPOOL_PROFILE
+        if(parkedThreadSize_>0 && notifyNs_==0)
+            notifyNs_=ProfiledLock::now();
+#endif
+    }
+
+    //线程开始在notEmpty_上等待
+    std::uint64_t beginParkLocked()
+    {
+#ifdef THREADPOOL_PROFILE
+        parkedThreadSize_++;
+        return ProfiledLock::now();
+#else
+        return 0;
+#endif
+    }
+
+    //线程被唤醒(已重新持有锁)
+    void endParkLocked(std::uint64_t parkedNs)
+    {
+#ifdef THREADPOOL_PROFILE
+        parkedThreadSize_--;
+        if(notifyNs_!=0 && notifyNs_>=parkedNs){
+            wakeupProfile_.record(ProfiledLock::now()-notifyNs_);
+            notifyNs_=0;
+        }
+#else
+        (void)parkedNs;
+#endif
+    }
+
     //定义线程函数：
     //1.线程由线程池创建，故线程能使用的函数由线程池提供
     //2.方便线程函数访问线程池中的变量
     void threadFunc(int threadId) //含有参数：this指针
     {
+        //记录当前线程所属的线程池，BlockingRegion通过它找到线程池
+        currentPool()=this;
+
         //线程上一次执行完任务的时间
         auto lastTime=std::chrono::high_resolution_clock().now();
     
+        //线程本地的任务缓冲区：一次加锁取出多个任务，摊薄锁的开销
+        std::vector<Task> batch;
+        batch.reserve(taskBatchSize_);
+
+        //找到创建线程时分配的本地队列(submitWithKey使用)
+        int slot;
+        {
+            auto lock=lockTaskQue(LockSite::SPAWN);
+            slot=ownedAffinitySlotLocked(threadId);
+            if(slot<0)
+                slot=claimAffinitySlotLocked(threadId);
+        }
+        currentAffinitySlot()=slot;
+
         for(;;){
-            Task task;
             {
                 //先获取锁
-                std::unique_lock<std::mutex> lock(taskQueMtx_); 
+                auto lock=lockTaskQue(LockSite::DEQUEUE); 
                 
-                std::cout<<"tid: "<<std::this_thread::get_id()<<" 尝试获取任务..."<<std::endl;
+                THREADPOOL_LOG("tid: "<<std::this_thread::get_id()<<" 尝试获取任务...");
                             
                 //没有任务时，轮询
                 //双重判断isPoolRunning
-                while(taskQue_.size()==0){
+                for(;;){
+                    //阻塞区域结束后多出来的补偿线程：执行完手头的任务后退出
+                    if(retireThreadSize_>0){
+                        retireThreadSize_--;
+                        exitThreadLocked(threadId,slot);
+                        return;
+                    }
+                    if(hasTaskLocked(slot)){
+                        break;
+                    }
 
                     if(!isPoolRunning_){
                         //执行完任务的线程发现isPoolRunning_=false：会自动跳出循环，进而进行回收
-                        threads_.erase(threadId); //不能传入this_thread::get_id()
-                        //修改线程数量相关变量
-                        curThreadSize_--;
-                        idleThreadSize_--;
-                        //创建时使用this_thread::get_id,这里打印也就使用this_thread::get_id
-                        std::cout<<"threadId: "<<std::this_thread::get_id()<<"exit!"<<std::endl;
-                        exitCond_.notify_all();
+                        exitThreadLocked(threadId,slot);
                         return;//线程函数借宿线程结束
                     }
 
@@ -269,7 +865,10 @@ private:
                     {
                         //每秒返回一次   怎么区分：超时返回？还是有任务待执行返回
                         //.wait_for()方法的返回值可以区分是否超时
-                        if(std::cv_status::timeout ==notEmpty_.wait_for(lock,std::chrono::seconds(1)))
+                        std::uint64_t parkedNs=beginParkLocked();
+                        std::cv_status status=notEmpty_.wait_for(lock,std::chrono::seconds(1));
+                        endParkLocked(parkedNs);
+                        if(std::cv_status::timeout ==status)
                         {
                             auto now=std::chrono::high_resolution_clock().now(); //获取当前时间
                             //通过std::chrono::duration_cast<std::chrono::seconds>强制类型转换为”秒“
@@ -278,14 +877,7 @@ private:
                             if( curThreadSize_>initThreadSize_ 
                                 && dur.count()>=THread_MAX_IDLE_TIME)
                             {
-                                threads_.erase(threadId); //不能传入this_thread::get_id()
-                                //修改线程数量相关变量
-                                curThreadSize_--;
-                                idleThreadSize_--;
-        
-                                //创建时使用this_thread::get_id,这里打印也就使用this_thread::get_id
-                                std::cout<<"threadId: "<<std::this_thread::get_id()<<"exit!"<<std::endl;
-
+                                exitThreadLocked(threadId,slot);
                                 return; //直接返回，退出for循环，线程结束
                             }
                         }
@@ -293,21 +885,21 @@ private:
                     else
                     {
                         //等待notEmpty条件(fixed模式下，一直等待即可)
+                        std::uint64_t parkedNs=beginParkLocked();
                         notEmpty_.wait(lock);
+                        endParkLocked(parkedNs);
                     }
                 }
 
                 //执行任务
-                idleThreadSize_--; //分配任务：空闲线程数量-1
-                std::cout<<"tid: "<<std::this_thread::get_id()<<" 获取任务成功..."<<std::endl;
+                idleThreadSize_.add(threadId,-1); //分配任务：空闲线程数量-1(只修改本线程的分片)
+                THREADPOOL_LOG("tid: "<<std::this_thread::get_id()<<" 获取任务成功...");
 
-                //从任务队列中取一个任务出来
-                task=taskQue_.front();
-                taskQue_.pop();
-                taskSize_--;
+                takeTasksLocked(slot,batch);
 
                 //如果依然有剩余任务，通知另一个线程执行任务
-                if(taskQue_.size()>0){
+                if(taskSize_>0){
+                    markNotifyLocked();
                     notEmpty_.notify_all();
                 }
 
@@ -317,47 +909,788 @@ private:
                 //右括号：调用”析构函数“——>释放掉锁（一定要在执行前释放，否则在执行前都不释放锁，变为串行）
             }
 
-            //当前线程执行该任务
+            //当前线程依次执行本地缓冲区中的任务
             //条件变量可能发生”假醒“——>苏醒之后要再次检查条件
-            if(task!=nullptr){
-                task();
+            //任务进入阻塞区域时，enterBlocking()会把缓冲区中尚未执行的任务放回队列(见currentBatch())
+            BatchCursor& cursor=currentBatch();
+            cursor.batch_=&batch;
+            for(cursor.next_=0;cursor.next_<batch.size();){
+                Task task=std::move(batch[cursor.next_++]);
+                if(task!=nullptr){
+                    task();
+                }
             }
-            idleThreadSize_++; //任务处理结束：空闲线程数量+1
+            cursor.batch_=nullptr;
+            batch.clear();
+            idleThreadSize_.add(threadId,1); //任务处理结束：空闲线程数量+1
 
             lastTime=std::chrono::high_resolution_clock().now();//更新线程执行完任务的时间
 
         }
     }
 
+    //取出一批任务放入batch：先取自己的本地队列，再按DRR取任务组，最后窃取积压的本地队列（调用方需持有taskQueMtx_）
+    void takeTasksLocked(int slot,std::vector<std::function<void()>>& batch)
+    {
+        auto& own=affinityQues_[slot].que_;
+        if(!own.empty()){
+            //本地队列中的任务本来就只属于自己，不存在囤积问题
+            std::size_t batchSize=std::min<std::size_t>(taskBatchSize_,own.size());
+            for(std::size_t i=0;i<batchSize;++i){
+                batch.emplace_back(std::move(own.front()));
+                own.pop();
+            }
+            affinityTaskSize_-=batchSize;
+            notFull_.notify_all();
+            return;
+        }
+
+        if(taskSize_>0){
+            //本次取出的任务数：不超过taskBatchSize_，且不超过“平均每个线程分到的任务数”
+            //队列较短时每次只取一个，避免一个线程把少量任务全部囤积在本地，其它线程却空闲
+            std::size_t fairShare=(taskSize_+curThreadSize_-1)/std::max(1,(int)curThreadSize_);
+            std::size_t batchSize=std::min<std::size_t>(taskBatchSize_,std::max<std::size_t>(1,fairShare));
+
+            //按DRR从各任务组中取出任务
+            for(std::size_t i=0;i<batchSize;++i){
+                batch.emplace_back(popTaskLocked());
+            }
+            taskSize_-=batchSize;
+            return;
+        }
+
+        //窃取：每次只取一个，尽量让任务留在原线程上
+        int victim=findStealableLocked(slot);
+        if(victim>=0){
+            auto& que=affinityQues_[victim].que_;
+            batch.emplace_back(std::move(que.front()));
+            que.pop();
+            affinityTaskSize_--;
+            notFull_.notify_all();
+        }
+    }
+
+    //当前线程是否有任务可取（调用方需持有taskQueMtx_）
+    bool hasTaskLocked(int slot)
+    {
+        return taskSize_>0
+            || !affinityQues_[slot].que_.empty()
+            || findStealableLocked(slot)>=0;
+    }
+
+    //找一个允许窃取的本地队列：积压过多，所属线程正处于阻塞区域中，或者所属线程已经退出（调用方需持有taskQueMtx_）
+    int findStealableLocked(int slot)
+    {
+        for(std::size_t i=0;i<affinityQues_.size();++i){
+            const AffinityQueue& aq=affinityQues_[i];
+            if((int)i==slot || aq.que_.empty())
+                continue;
+            if(aq.owner_<0 || aq.ownerBlocked_ || aq.que_.size()>affinityStealThreshholdLocked())
+                return (int)i;
+        }
+        return -1;
+    }
+
+    //本地队列的窃取阈值：本地队列与默认任务组共用队列上限，阈值必须小于上限，否则队列满之前永远不会触发窃取
+    std::size_t affinityStealThreshholdLocked() const
+    {
+        std::size_t capacity=taskGroups_[0].capacity_;
+        return std::min<std::size_t>(AFFINITY_STEAL_THRESHHOLD,capacity>0 ? capacity-1 : 0);
+    }
+
+    //线程threadId在创建时分配到的本地队列（调用方需持有taskQueMtx_）
+    int ownedAffinitySlotLocked(int threadId) const
+    {
+        for(std::size_t i=0;i<affinityQues_.size();++i){
+            if(affinityQues_[i].owner_==threadId)
+                return (int)i;
+        }
+        return -1;
+    }
+
+    //认领一个空闲的本地队列，没有则新建（调用方需持有taskQueMtx_）
+    int claimAffinitySlotLocked(int threadId)
+    {
+        for(std::size_t i=0;i<affinityQues_.size();++i){
+            if(affinityQues_[i].owner_<0){
+                affinityQues_[i].owner_=threadId;
+                affinityQues_[i].ownerBlocked_=false;
+                return (int)i;
+            }
+        }
+        affinityQues_.emplace_back();
+        affinityQues_.back().owner_=threadId;
+        return (int)affinityQues_.size()-1;
+    }
+
+    //把任务放入指定任务组：队列满时最多等待1秒，仍然满则返回false
+    bool enqueueTask(int groupId,std::function<void()> task)
+    {
+        //获取锁
+        auto lock=lockTaskQue(LockSite::SUBMIT);
+        //条件不满足，最多阻塞1秒，超过1秒则提交失败
+        if(groupId<0 || groupId>=(int)taskGroups_.size()
+            || !notFull_.wait_for(lock,std::chrono::seconds(1),[&]()
+            ->bool{ return taskGroups_[groupId].que_.size()<taskGroups_[groupId].capacity_;}))
+        {
+            //notFull_等待1秒，条件还是不满足
+            std::cerr<<"task queue is full,submit task fail."<<std::endl;
+            return false;
+        }
+        //如果有空余，把任务放入该组的任务队列中
+        taskGroups_[groupId].que_.emplace(std::move(task));
+        taskSize_++;
+        //因为有新任务，任务队列肯定不空，在notEmpty_上进行通知,分配线程执行任务
+        markNotifyLocked();
+        notEmpty_.notify_all();
+
+        //cached模式：任务处理比较紧急  场景：小而快的任务， 需要根据任务数量和空闲线程的数量，判断是否需要增加/删除线程
+        addThreadIfNeeded();
+        return true;
+    }
+
+    //单飞任务结束：不缓存则去掉登记，否则记录过期时间（只处理本次登记，避免误删后来的登记）
+    void finishOnce(const std::string& key,std::chrono::milliseconds cacheTtl,std::uint64_t generation)
+    {
+        std::unique_lock<std::mutex> lock(onceMtx_);
+        auto it=onceTasks_.find(key);
+        if(it==onceTasks_.end() || it->second.generation_!=generation)
+            return;
+        if(cacheTtl.count()<=0){
+            onceTasks_.erase(it);
+            return;
+        }
+        it->second.done_=true;
+        it->second.expire_=std::chrono::steady_clock::now()+cacheTtl;
+        onceExpiry_.push(OnceExpiry{it->second.expire_,generation,key});
+    }
+
+    //删除已过期的缓存结果（调用方需持有onceMtx_）
+    //只在同一个key再次提交时才删除的话，大量不同key的提交会让onceTasks_无限增长
+    //onceExpiry_按过期时间排序，每次只弹出已过期的部分，均摊O(log n)
+    void sweepExpiredOnceLocked()
+    {
+        auto now=std::chrono::steady_clock::now();
+        while(!onceExpiry_.empty() && onceExpiry_.top().expire_<=now){
+            const OnceExpiry& top=onceExpiry_.top();
+            auto it=onceTasks_.find(top.key_);
+            //同一个key可能已被重新登记：只删除对应这一次登记的缓存
+            if(it!=onceTasks_.end() && it->second.generation_==top.generation_ && it->second.done_)
+                onceTasks_.erase(it);
+            onceExpiry_.pop();
+        }
+    }
+
+    //赤字轮转(Deficit Round Robin)：轮到某个组时，其赤字增加weight_，每取一个任务消耗1
+    //负载过高时各组取到的任务数与权重成正比，吵闹的租户无法饿死其它租户（调用方需持有taskQueMtx_且taskSize_>0）
+    std::function<void()> popTaskLocked()
+    {
+        for(;;){
+            TaskGroup& group=taskGroups_[drrCursor_];
+            if(!group.que_.empty() && group.deficit_>0){
+                group.deficit_--;
+                Task task=std::move(group.que_.front());
+                group.que_.pop();
+                return task;
+            }
+            if(group.que_.empty()){
+                group.deficit_=0; //空队列不积累赤字
+            }
+            //轮到下一个组，给非空的组补充本轮配额
+            drrCursor_=(drrCursor_+1)%taskGroups_.size();
+            TaskGroup& next=taskGroups_[drrCursor_];
+            if(!next.que_.empty()){
+                next.deficit_+=next.weight_;
+            }
+        }
+    }
+
+    //cached模式下根据任务数量与空闲线程数量判断是否需要增加线程（调用方需持有taskQueMtx_）
+    void addThreadIfNeeded()
+    {
+        if(poolMode_==PoolMode::MODE_CACHED //线程池工作在cached模式
+            && (long)(taskSize_+affinityTaskSize_)>idleThreadSize_.load()      //任务数量(含本地队列)大于空闲线程数量
+            && curThreadSize_<threadSizeThreshHold_)  //当前线程池内线程数量小于线程数量阈值
+        {
+            addThreadLocked();
+        }
+    }
+
+    //创建并启动一个新线程（调用方需持有taskQueMtx_）
+    void addThreadLocked()
+    {
+#ifdef THREADPOOL_PROFILE
+        std::uint64_t spawnNs=ProfiledLock::now();
+#endif
+        std::cout<<"create new thread: "<<std::this_thread::get_id()<<std::endl;
+
+        // 创建新线程对象
+        auto ptr=std::make_unique<Thread>(std::bind(&ThreadPool::threadFunc,this,std::placeholders::_1));
+        //threads_.emplace_back(std::move(ptr));
+        int threadId=ptr->getId();
+            //注意：emplace与insert不同，emplace是以初值安插，insert是以拷贝安插
+        threads_.emplace(threadId,std::move(ptr));
+        //先分配本地队列再启动线程
+        claimAffinitySlotLocked(threadId);
+        //启动线程
+        threads_[threadId]->start();
+        //修改线程数量相关变量 
+        curThreadSize_++;
+        idleThreadSize_.add(threadId,1);
+#ifdef THREADPOOL_PROFILE
+        //持锁创建线程的耗时：计入SPAWN的持有时间(等待时间为0)
+        lockProfile_[(int)LockSite::SPAWN].hold_.record(ProfiledLock::now()-spawnNs);
+#endif
+    }
+
+    //当前线程退出前的清理（调用方需持有taskQueMtx_）
+    void exitThreadLocked(int threadId,int slot)
+    {
+        //释放本地队列：剩余任务变为可窃取，唤醒其它线程来取
+        affinityQues_[slot].owner_=-1;
+        if(!affinityQues_[slot].que_.empty()){
+            notEmpty_.notify_all();
+        }
+        threads_.erase(threadId); //不能传入this_thread::get_id()
+        //修改线程数量相关变量
+        curThreadSize_--;
+        idleThreadSize_.add(threadId,-1);
+        //补偿线程也可能经cached模式的空闲超时退出：补偿数量不能超过目标之外的线程数，否则之后resize()会多建线程
+        compensateThreadSize_=std::max(0,std::min(compensateThreadSize_,
+                                curThreadSize_-retireThreadSize_-(int)initThreadSize_));
+        //创建时使用this_thread::get_id,这里打印也就使用this_thread::get_id
+        std::cout<<"threadId: "<<std::this_thread::get_id()<<"exit!"<<std::endl;
+        exitCond_.notify_all();
+    }
+
+    //当前线程正在执行的任务缓冲区：batch_[next_]及之后的任务还没有开始执行
+    struct BatchCursor
+    {
+        std::vector<std::function<void()>>* batch_=nullptr;
+        std::size_t next_=0;
+    };
+    static BatchCursor& currentBatch()
+    {
+        static thread_local BatchCursor cursor;
+        return cursor;
+    }
+
+    //当前线程所属的线程池(不是线程池线程则为nullptr)
+    static ThreadPool*& currentPool()
+    {
+        static thread_local ThreadPool* pool=nullptr;
+        return pool;
+    }
+
+    //当前线程的本地队列下标(不是线程池线程则为-1)
+    static int& currentAffinitySlot()
+    {
+        static thread_local int slot=-1;
+        return slot;
+    }
+
+    //当前线程所处的阻塞区域嵌套层数：只有最外层调用enterBlocking()/exitBlocking()
+    static int& blockingDepth()
+    {
+        static thread_local int depth=0;
+        return depth;
+    }
+
+    //进入阻塞区域：保证未阻塞的线程数不低于initThreadSize_
+    void enterBlocking()
+    {
+        auto lock=lockTaskQue(LockSite::CONTROL);
+        blockedThreadSize_++;
+
+        //当前线程缓冲区中还没执行的任务放回0号组，让其它(补偿)线程执行，不必等这次阻塞结束
+        //放回后不再保持原来的顺序与本地队列亲和性
+        BatchCursor& cursor=currentBatch();
+        if(cursor.batch_!=nullptr && cursor.next_<cursor.batch_->size()){
+            std::vector<Task>& batch=*cursor.batch_;
+            for(std::size_t i=cursor.next_;i<batch.size();++i){
+                taskGroups_[0].que_.emplace(std::move(batch[i]));
+                taskSize_++;
+            }
+            batch.resize(cursor.next_);
+            markNotifyLocked();
+            notEmpty_.notify_all();
+        }
+        //本地队列在阻塞期间允许其它(补偿)线程窃取，否则排在后面的同key任务要等阻塞结束
+        int slot=currentAffinitySlot();
+        if(slot>=0){
+            affinityQues_[slot].ownerBlocked_=true;
+            if(!affinityQues_[slot].que_.empty()){
+                markNotifyLocked();
+                notEmpty_.notify_all();
+            }
+        }
+        if(retireThreadSize_>0){
+            //还有等待退出的补偿线程：直接留下它，不必新建
+            retireThreadSize_--;
+            compensateThreadSize_++;
+        }
+        else if(curThreadSize_-blockedThreadSize_<(int)initThreadSize_
+            && curThreadSize_<threadSizeThreshHold_)
+        {
+            addThreadLocked();
+            compensateThreadSize_++;
+        }
+    }
+
+    //离开阻塞区域：线程数超出目标时让一个补偿线程退出
+    void exitBlocking()
+    {
+        auto lock=lockTaskQue(LockSite::CONTROL);
+        blockedThreadSize_--;
+        int slot=currentAffinitySlot();
+        if(slot>=0)
+            affinityQues_[slot].ownerBlocked_=false;
+        if(compensateThreadSize_>0
+            && curThreadSize_-retireThreadSize_-blockedThreadSize_>(int)initThreadSize_)
+        {
+            compensateThreadSize_--;
+            retireThreadSize_++;
+            notEmpty_.notify_all(); //唤醒空闲线程让它退出
+        }
+    }
+
     //检查pool的运行状态（可能多个地方调用，且都是内部方法）
     bool checkRunningState() const
     {
         return isPoolRunning_;
     }
 private:
-    //池内线程相关
-    // std::vector<std::unique_ptr<Thread>> threads_; //线程列表
-    std::unordered_map<int,std::unique_ptr<Thread>> threads_; //线程列表
+    //成员按访问方式分组，组与组之间按缓存行对齐：
+    //1.配置与线程数量：启动、调整时才修改，其余时间只读，可以长期留在各核心的缓存中
+    //2.taskQueMtx_与它保护的任务队列：提交与取任务时随锁一起在核心间传递
+    //3.空闲线程数量：每个线程在每批任务前后修改，使用分片计数器
+    //4.单飞任务：使用独立的锁，不与任务队列共享缓存行
+
+    //线程池配置(只读为主)
+    alignas(CACHE_LINE_SIZE) PoolMode poolMode_; //当前线程池的工作模式
+    std::atomic_bool isPoolRunning_; //当前线程是否已经开始（开始后不允许在设置Mode）
     std::size_t initThreadSize_; //初始线程数量 
-    std::atomic_int curThreadSize_; //当前线程池中的总数量
-    std::atomic_int idleThreadSize_; //空闲线程数量(cached模式使用)
     int threadSizeThreshHold_; //线程数量的阈值(cached模式才可设置)
+    int taskBatchSize_; //线程一次加锁最多取出的任务数
+    bool detectCpuQuota_; //默认线程数量是否参考cgroup CPU配额
+    std::atomic_int curThreadSize_; //当前线程池中的总数量(只在创建/退出线程时修改)
+
+    //池内安全相关
+    alignas(CACHE_LINE_SIZE) std::mutex taskQueMtx_; //保证任务队列的线程安全
+    PoolCondition notFull_; //表示任务队列不满
+    PoolCondition notEmpty_;  //表示任务队列不空
+    PoolCondition exitCond_; //等待线程资源全部回收
 
-    //池内任务相关
+    //池内线程相关(受taskQueMtx_保护)
+    // std::vector<std::unique_ptr<Thread>> threads_; //线程列表
+    std::unordered_map<int,std::unique_ptr<Thread>> threads_; //线程列表
+    int blockedThreadSize_; //正处于阻塞区域中的线程数量
+    int compensateThreadSize_; //因阻塞区域而额外创建/保留的补偿线程数量
+    int retireThreadSize_; //等待退出的线程数量（由空闲下来的线程认领）
+
+    //池内任务相关(受taskQueMtx_保护)
     using Task=std::function<void()>;
-    std::queue<Task> taskQue_; //任务队列
-    std::atomic_uint taskSize_; //任务数量（因为是动态的，可能发送“竞争”，所以用“原子类型”）
-    int taskQueMaxThreshHold_; //任务队列数量上线阈值（因为不会变，所以用普通类型即可）
+    //任务组(租户)：每个组有独立的任务队列、权重与队列上限
+    struct TaskGroup
+    {
+        TaskGroup(int weight,int capacity)
+            : weight_(weight)
+            , capacity_(capacity)
+            , deficit_(0)
+        {}
+        std::queue<Task> que_; //该组的任务队列
+        int weight_; //权重
+        std::size_t capacity_; //任务队列数量上限阈值
+        int deficit_; //DRR赤字：本轮还可以取的任务数
+    };
+    std::vector<TaskGroup> taskGroups_; //任务组列表（0号为默认组）
+    //线程本地队列：submitWithKey按key的哈希值选择
+    struct AffinityQueue
+    {
+        std::queue<Task> que_;
+        int owner_=-1; //所属线程id，-1表示无主(任何线程都可以取)
+        bool ownerBlocked_=false; //所属线程正处于阻塞区域中(任何线程都可以取)
+    };
+    std::vector<AffinityQueue> affinityQues_; //本地队列列表（只增不减，线程退出后由新线程认领）
+    std::size_t drrCursor_; //DRR当前轮到的组
+    std::size_t taskSize_; //所有组的任务总数（只在持有taskQueMtx_时读写，不必再用原子类型）
+    std::size_t affinityTaskSize_; //所有本地队列的任务总数（cached模式扩容判断使用）
 
-    //池内安全相关
-    std::mutex taskQueMtx_; //保证任务队列的线程安全
-    std::condition_variable notFull_; //表示任务队列不满
-    std::condition_variable notEmpty_;  //表示任务队列不空
-    std::condition_variable exitCond_; //等待线程资源全部回收
+    //空闲线程数量(cached模式使用)：每个线程只修改自己的分片
+    ShardedCounter idleThreadSize_;
 
-    //线程池状态
-    PoolMode poolMode_; //当前线程池的工作模式
-    std::atomic_bool isPoolRunning_; //当前线程是否已经开始（开始后不允许在设置Mode）
+#ifdef THREADPOOL_PROFILE
+    //性能分析数据(受taskQueMtx_保护)
+    LockSiteProfile lockProfile_[(int)LockSite::COUNT]; //各调用位置的锁等待/持有时间
+    LatencyStats wakeupProfile_; //空闲线程从被通知到重新持有锁的延迟
+    int parkedThreadSize_=0; //正在notEmpty_上等待的线程数量
+    std::uint64_t notifyNs_=0; //第一个尚未被响应的通知的时刻，0表示没有
+#endif
+
+    //单飞任务相关
+    struct OnceEntry
+    {
+        std::any future_; //std::shared_future<RType>
+        std::uint64_t generation_=0; //登记编号
+        bool done_=false; //是否已完成(只有缓存结果时才会保留已完成的登记)
+        std::chrono::steady_clock::time_point expire_; //缓存过期时间
+    };
+    alignas(CACHE_LINE_SIZE) std::mutex onceMtx_; //保护onceTasks_（不与taskQueMtx_嵌套持有）
+    std::unordered_map<std::string,OnceEntry> onceTasks_; //key -> 排队/执行中/缓存中的任务
+    std::uint64_t onceGeneration_=0;
+    //缓存结果的过期队列(最早过期的在堆顶)
+    struct OnceExpiry
+    {
+        std::chrono::steady_clock::time_point expire_;
+        std::uint64_t generation_;
+        std::string key_;
+        bool operator>(const OnceExpiry& other) const { return expire_>other.expire_; }
+    };
+    std::priority_queue<OnceExpiry,std::vector<OnceExpiry>,std::greater<OnceExpiry>> onceExpiry_;
+};
+
+/*
+Strand(串行执行器):
+1.同一个key(连接、账户等)的任务不能并发执行，以前为每个key单独开一个线程数为1的线程池，导致大量空闲线程
+2.Strand把任务放入自己的无锁队列(多生产者、单消费者)，只有在队列由空变为非空时才向线程池投递一个drain任务
+3.任一时刻最多只有一个线程在drain同一个Strand，所以任务按FIFO顺序、互不重叠地执行
+
+example:
+auto strand=pool.makeStrand();
+strand->post([](){ ... });
+std::future<int> r=strand->submitTask(sum1,1,2);
+*/
+class Strand: public std::enable_shared_from_this<Strand>
+{
+public:
+    explicit Strand(ThreadPool& pool)
+        : pool_(pool)
+        , head_(&stub_)
+        , tail_(&stub_)
+        , pending_(0)
+    {}
+
+    ~Strand()
+    {
+        //drain任务持有shared_ptr，走到这里说明队列里已经没有待执行的任务
+        Node* node=tail_;
+        while(node!=nullptr){
+            Node* next=node->next_.load(std::memory_order_relaxed);
+            if(node!=&stub_){
+                delete node;
+            }
+            node=next;
+        }
+    }
+
+    //投递一个无返回值的任务
+    void post(std::function<void()> task)
+    {
+        push(new Node(std::move(task)));
+        //队列由空变为非空：当前没有线程在drain，需要向线程池投递一个drain任务
+        if(pending_.fetch_add(1,std::memory_order_acq_rel)==0){
+            schedule();
+        }
+    }
+
+    //与ThreadPool::submitTask用法相同，但任务在Strand上串行执行
+    template<typename Func,typename... Args>
+    auto submitTask(Func&& func,Args&&... args)->std::future<decltype(func(args...))>
+    {
+        using RType=decltype(func(args...));
+        auto task=std::make_shared<std::packaged_task<RType()>>(
+                    std::bind(std::forward<Func>(func),std::forward<Args>(args)...));
+        std::future<RType> result=task->get_future();
+        post([task](){ (*task)(); });
+        return result;
+    }
+
+    //当前线程是否正在执行该Strand上的任务
+    bool runningInThisThread() const
+    {
+        return currentStrand()==this;
+    }
+
+    Strand(const Strand&)=delete;
+    Strand& operator=(const Strand&)=delete;
+
+private:
+    //一次drain最多执行的任务数，超过后重新投递，避免一个繁忙的Strand长期占用某个线程
+    static const int STRAND_MAX_DRAIN_BATCH=64;
+
+    struct Node
+    {
+        Node()=default;
+        explicit Node(std::function<void()> task):task_(std::move(task)){}
+        std::function<void()> task_;
+        std::atomic<Node*> next_{nullptr};
+    };
+
+    static const Strand*& currentStrand()
+    {
+        static thread_local const Strand* strand=nullptr;
+        return strand;
+    }
+
+    void schedule()
+    {
+        auto self=shared_from_this();
+        pool_.post([self](){ self->drain(); });
+    }
+
+    //多生产者入队：只有一次exchange，不需要加锁
+    void push(Node* node)
+    {
+        node->next_.store(nullptr,std::memory_order_relaxed);
+        Node* prev=head_.exchange(node,std::memory_order_acq_rel);
+        prev->next_.store(node,std::memory_order_release);
+    }
+
+    //单消费者出队：生产者exchange之后、链接next之前的短暂窗口内会返回nullptr
+    Node* pop()
+    {
+        Node* tail=tail_;
+        Node* next=tail->next_.load(std::memory_order_acquire);
+        if(tail==&stub_){
+            if(next==nullptr){
+                return nullptr;
+            }
+            tail_=next;
+            tail=next;
+            next=next->next_.load(std::memory_order_acquire);
+        }
+        if(next!=nullptr){
+            tail_=next;
+            return tail;
+        }
+        if(tail!=head_.load(std::memory_order_acquire)){
+            return nullptr;
+        }
+        //队列中只剩最后一个节点：重新放入stub，才能把它取出来
+        push(&stub_);
+        next=tail->next_.load(std::memory_order_acquire);
+        if(next!=nullptr){
+            tail_=next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+    //由线程池中的某个线程执行，pending_保证同一时刻只有一个drain在运行
+    void drain()
+    {
+        const Strand* prevStrand=currentStrand();
+        currentStrand()=this;
+        for(int i=0;i<STRAND_MAX_DRAIN_BATCH;++i){
+            Node* node;
+            //pending_>0说明一定有任务，取不到只是生产者还没链接完成，稍等即可
+            while((node=pop())==nullptr){
+                std::this_thread::yield();
+            }
+            node->task_();
+            delete node;
+            if(pending_.fetch_sub(1,std::memory_order_acq_rel)==1){
+                currentStrand()=prevStrand;
+                return; //队列已空，释放drain权
+            }
+        }
+        currentStrand()=prevStrand;
+        //还有剩余任务：重新排队，把线程让给其它任务
+        schedule();
+    }
+
+private:
+    ThreadPool& pool_;
+    Node stub_; //哨兵节点
+    std::atomic<Node*> head_; //生产者端
+    Node* tail_; //消费者端(只有drain线程访问)
+    std::atomic_size_t pending_; //已投递但尚未执行完的任务数
 };
 
-#endif 
\ No newline at end of file
+inline std::shared_ptr<Strand> ThreadPool::makeStrand()
+{
+    return std::make_shared<Strand>(*this);
+}
+
+/*
+TaskArena(任务区):
+1.进程中每个库各自构造ThreadPool并start()内核数量的线程，三个库就是3倍内核数的线程互相争抢CPU
+2.各组件改为共用ThreadPool::defaultPool()，每个组件在上面创建自己的TaskArena；任务区不拥有线程，只限制自己同时占用的池内线程数
+3.任务区内最多同时有maxConcurrency个drain任务在池中执行，每个drain依次执行任务区队列中的任务；总线程数始终是默认线程池的线程数
+  一个组件任务再多也只能占用它的上限，其余线程留给其它组件；嵌套提交(任务中再提交到任务区)只是排队，不会新增线程
+4.任务区的任务中等待同一任务区的嵌套任务时，必须把等待放在ThreadPool::BlockingRegion中：
+  阻塞期间让出当前线程占用的名额，排队的嵌套任务才能被其它drain执行，离开时再取回名额(可能短暂超过上限，当前任务执行完后多出的drain退出)
+  不用BlockingRegion直接get()，在名额用完(例如上限为1)时嵌套任务永远排在等待者之后，会死锁
+
+example:
+auto arena=ThreadPool::defaultPool().makeArena(2);
+arena->post([](){ ... });
+std::future<int> r=arena->submitTask(sum1,1,2);
+arena->post([arena](){
+    std::future<int> inner=arena->submitTask(sum1,3,4);
+    ThreadPool::BlockingRegion region; //等待嵌套任务期间让出名额
+    inner.get();
+});
+*/
+class TaskArena: public std::enable_shared_from_this<TaskArena>
+{
+public:
+    TaskArena(ThreadPool& pool,int maxConcurrency)
+        : pool_(pool)
+        , maxConcurrency_(std::max(1,maxConcurrency))
+        , activeSize_(0)
+    {}
+
+    //投递一个无返回值的任务
+    void post(std::function<void()> task)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        taskQue_.emplace(std::move(task));
+        //还没达到并发上限：再占用一个池内线程
+        if(activeSize_<maxConcurrency_){
+            activeSize_++;
+            lock.unlock();
+            schedule();
+        }
+    }
+
+    //与ThreadPool::submitTask用法相同，但任务在任务区的并发上限内执行
+    template<typename Func,typename... Args>
+    auto submitTask(Func&& func,Args&&... args)->std::future<decltype(func(args...))>
+    {
+        using RType=decltype(func(args...));
+        auto task=std::make_shared<std::packaged_task<RType()>>(
+                    std::bind(std::forward<Func>(func),std::forward<Args>(args)...));
+        std::future<RType> result=task->get_future();
+        post([task](){ (*task)(); });
+        return result;
+    }
+
+    //运行中调整并发上限：调大时立即为排队的任务补充drain，调小时多出的drain执行完手头任务后退出
+    void setMaxConcurrency(int maxConcurrency)
+    {
+        int more=0;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            maxConcurrency_=std::max(1,maxConcurrency);
+            while(activeSize_+more<maxConcurrency_ && (std::size_t)more<taskQue_.size()){
+                more++;
+            }
+            activeSize_+=more;
+        }
+        for(int i=0;i<more;++i){
+            schedule();
+        }
+    }
+
+    int getMaxConcurrency() const
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        return maxConcurrency_;
+    }
+
+    TaskArena(const TaskArena&)=delete;
+    TaskArena& operator=(const TaskArena&)=delete;
+
+private:
+    friend class ThreadPool::BlockingRegion;
+
+    //当前线程正在执行其任务的任务区
+    static TaskArena*& currentArena()
+    {
+        thread_local TaskArena* arena=nullptr;
+        return arena;
+    }
+
+    //任务进入阻塞区：让出名额，队列中还有任务时另起一个drain接替
+    void releaseSlot()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            activeSize_--;
+            if(taskQue_.empty() || activeSize_>=maxConcurrency_)
+                return;
+            activeSize_++;
+        }
+        schedule();
+    }
+
+    //离开阻塞区：取回名额，超出上限的部分由drain在取下一个任务时归还
+    void reacquireSlot()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        activeSize_++;
+    }
+
+    //一次drain最多执行的任务数，超过后重新投递，让同一线程池中其它任务区的任务也能得到执行
+    static const int ARENA_MAX_DRAIN_BATCH=64;
+
+    void schedule()
+    {
+        auto self=shared_from_this();
+        pool_.post([self](){ self->drain(); });
+    }
+
+    void drain()
+    {
+        for(int i=0;i<ARENA_MAX_DRAIN_BATCH;++i){
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                //队列已空，或并发上限被调小：释放占用的线程
+                if(taskQue_.empty() || activeSize_>maxConcurrency_){
+                    activeSize_--;
+                    return;
+                }
+                task=std::move(taskQue_.front());
+                taskQue_.pop();
+            }
+            TaskArena* prev=currentArena();
+            currentArena()=this;
+            task();
+            currentArena()=prev;
+        }
+        //还有剩余任务：重新排队，把线程让给其它任务
+        schedule();
+    }
+
+private:
+    ThreadPool& pool_;
+    mutable std::mutex mtx_; //保护任务队列与并发计数
+    std::queue<std::function<void()>> taskQue_; //任务区的任务队列
+    int maxConcurrency_; //并发上限
+    int activeSize_; //正在池中执行(或已投递)的drain数量
+};
+
+inline ThreadPool::BlockingRegion::BlockingRegion()
+    : pool_(currentPool())
+    , arena_(TaskArena::currentArena())
+{
+    //嵌套的阻塞区域(例如submitBlockingTask中调用orderedMap)：同一个线程只算阻塞一次，只补偿一个线程
+    if(pool_!=nullptr && blockingDepth()++==0)
+        pool_->enterBlocking();
+    if(arena_!=nullptr){
+        //嵌套的阻塞区不再重复让出名额
+        TaskArena::currentArena()=nullptr;
+        arena_->releaseSlot();
+    }
+}
+
+inline ThreadPool::BlockingRegion::~BlockingRegion()
+{
+    if(arena_!=nullptr){
+        arena_->reacquireSlot();
+        TaskArena::currentArena()=arena_;
+    }
+    if(pool_!=nullptr && --blockingDepth()==0)
+        pool_->exitBlocking();
+}
+
+inline std::shared_ptr<TaskArena> ThreadPool::makeArena(int maxConcurrency)
+{
+    if(maxConcurrency<=0)
+        maxConcurrency=std::max(1,getThreadSize());
+    return std::make_shared<TaskArena>(*this,maxConcurrency);
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef TYPED_THREADPOOL_FINAL_H
+#define TYPED_THREADPOOL_FINAL_H
+
+#include<vector>
+#include<tuple>
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<type_traits>
+#include<algorithm>
+#include<exception>
+#include "threadpool_final.h"
+
+const int TYPED_TASK_QUE_SIZE =1024; //环形任务队列默认容量
+
+/*
+TypedThreadPool：只执行一种任务签名的线程池
+1.ThreadPool每次提交都要经过std::bind、std::packaged_task、std::function三层类型擦除，且每个任务都要单独分配内存
+2.这里的任务函数类型Fn在编译期确定，队列是一块连续的环形数组，直接保存参数tuple和结果槽位指针
+3.线程取出参数后直接调用fn_(编译器可以内联)，结果写入用户预先分配好的槽位，不需要future
+要求：Args可默认构造、可移动赋值；Result为void时out传nullptr即可
+fn_会被多个线程同时调用，必须是线程安全的；fn_抛出的异常不会终止线程，第一个异常由wait()重新抛出
+
+example:
+struct Square{ int operator()(int x) const { return x*x; } };
+TypedThreadPool<Square,int,int> pool;
+pool.start(4);
+std::vector<int> results(100);
+for(int i=0;i<100;i++) pool.submitTask(&results[i],i);
+pool.wait(); //等待所有已提交任务完成后，results中即为结果
+*/
+template<typename Fn,typename Result,typename... Args>
+class TypedThreadPool{
+public:
+    explicit TypedThreadPool(Fn fn=Fn(),std::size_t capacity=TYPED_TASK_QUE_SIZE)
+        : fn_(std::move(fn))
+        , taskRing_(std::max<std::size_t>(1,capacity))
+        , taskHead_(0)
+        , taskSize_(0)
+        , pendingSize_(0)
+        , curThreadSize_(0)
+        , isPoolRunning_(false)
+    {}
+
+    ~TypedThreadPool()
+    {
+        isPoolRunning_=false;
+
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        notEmpty_.notify_all();
+
+        exitCond_.wait(lock,[&]()->bool{ return threads_.size()==0; });
+    }
+
+    //开启线程池(参数为线程数量,默认为"内核数量")
+    void start(int threadSize=std::thread::hardware_concurrency())
+    {
+        isPoolRunning_=true;
+        curThreadSize_=threadSize;
+
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        std::vector<int> threadIds;
+        for(int i=0;i<threadSize;++i){
+            auto ptr=std::make_unique<Thread>(std::bind(&TypedThreadPool::threadFunc,this,std::placeholders::_1));
+            int threadId=ptr->getId();
+            threads_.emplace(threadId,std::move(ptr));
+            threadIds.push_back(threadId);
+        }
+        for(int threadId:threadIds){
+            threads_[threadId]->start();
+        }
+    }
+
+    //提交任务：参数直接拷贝进环形队列，任务执行完后结果写入*out
+    //队列满时最多阻塞1秒，超时返回false(与ThreadPool::submitTask一致)
+    bool submitTask(Result* out,Args... args)
+    {
+        std::unique_lock<std::mutex> lock(taskQueMtx_);
+        if(!notFull_.wait_for(lock,std::chrono::seconds(1),[&]()
+            ->bool{ return taskSize_<taskRing_.size(); }))
+        {
+            std::cerr<<"task queue is full,submit task fail."<<std::endl;
+            return false;
+        }
+        Slot& slot=taskRing_[(taskHead_+taskSize_)%taskRing_.size()];
+        slot.args_=std::tuple<Args...>(std::move(args)...);
+        slot.out_=out;
+        taskSize_++;
+        pendingSize_++;
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    //等待所有已提交的任务执行完成；若有任务抛出异常，重新抛出其中第一个(抛出后清除)
+    void wait()
+    {
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(taskQueMtx_);
+            doneCond_.wait(lock,[&]()->bool{ return pendingSize_==0; });
+            std::swap(error,error_);
+        }
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+    TypedThreadPool(const TypedThreadPool&)=delete;
+    TypedThreadPool& operator=(const TypedThreadPool&)=delete;
+
+private:
+    //环形队列中的一个任务：参数tuple与结果槽位
+    struct Slot
+    {
+        std::tuple<Args...> args_;
+        Result* out_=nullptr;
+    };
+
+    void threadFunc(int threadId)
+    {
+        //线程本地缓冲区：与ThreadPool一样一次加锁取出多个任务
+        std::vector<Slot> batch;
+        batch.reserve(TASK_MAX_BATCH);
+
+        for(;;){
+            {
+                std::unique_lock<std::mutex> lock(taskQueMtx_);
+                //上一批任务在这里统一计入完成数，省掉一次加锁
+                if(!batch.empty()){
+                    pendingSize_-=batch.size();
+                    batch.clear();
+                    if(pendingSize_==0){
+                        doneCond_.notify_all();
+                    }
+                }
+
+                while(taskSize_==0){
+                    if(!isPoolRunning_){
+                        threads_.erase(threadId);
+                        curThreadSize_--;
+                        exitCond_.notify_all();
+                        return;
+                    }
+                    notEmpty_.wait(lock);
+                }
+
+                std::size_t fairShare=(taskSize_+curThreadSize_-1)/std::max(1,(int)curThreadSize_);
+                std::size_t batchSize=std::min<std::size_t>(TASK_MAX_BATCH,std::max<std::size_t>(1,fairShare));
+                for(std::size_t i=0;i<batchSize;++i){
+                    batch.emplace_back(std::move(taskRing_[taskHead_]));
+                    taskHead_=(taskHead_+1)%taskRing_.size();
+                }
+                taskSize_-=batchSize;
+
+                if(taskSize_>0){
+                    notEmpty_.notify_one();
+                }
+                notFull_.notify_all();
+            }
+
+            //静态已知的函数调用：没有虚函数、没有std::function
+            for(Slot& slot:batch){
+                try{
+                    if constexpr(std::is_void<Result>::value){
+                        std::apply(fn_,std::move(slot.args_));
+                    }
+                    else{
+                        *slot.out_=std::apply(fn_,std::move(slot.args_));
+                    }
+                }
+                catch(...){
+                    //异常不能逃出分离的线程(会std::terminate)，记下第一个交给wait()
+                    std::lock_guard<std::mutex> lock(taskQueMtx_);
+                    if(!error_)
+                        error_=std::current_exception();
+                }
+            }
+        }
+    }
+
+private:
+    Fn fn_; //任务函数
+
+    std::vector<Slot> taskRing_; //环形任务队列(连续内存，启动前一次分配)
+    std::size_t taskHead_; //队头下标
+    std::size_t taskSize_; //队列中的任务数
+    std::size_t pendingSize_; //已提交但未执行完的任务数
+    std::exception_ptr error_; //任务抛出的第一个异常(受taskQueMtx_保护)
+
+    std::unordered_map<int,std::unique_ptr<Thread>> threads_; //线程列表
+    std::atomic_int curThreadSize_; //线程数量
+
+    std::mutex taskQueMtx_; //保证任务队列的线程安全
+    std::condition_variable notFull_; //表示任务队列不满
+    std::condition_variable notEmpty_; //表示任务队列不空
+    std::condition_variable doneCond_; //所有任务执行完成
+    std::condition_variable exitCond_; //等待线程资源全部回收
+
+    std::atomic_bool isPoolRunning_; //线程池是否在运行
+};
+
+#endif